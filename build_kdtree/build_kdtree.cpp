@@ -2,7 +2,18 @@
 //
 //  This function gets two arguments from the console:
 //      (1) The absolute path to the train data (.csv)
-//      (2) The absolute path to save the model (.csv)
+//      (2) The absolute path to save the model (.csv, or a binary model for any other extension, e.g. .kdt)
+//
+//  Options (after the two arguments):
+//      --embed-points  stores the points in the binary model, so that query_kdtree does not need the train data.
+//      -t N            builds the tree on N threads (default: all the hardware threads).
+//      --leaf-size N   stops splitting at N points or less: the leaves are buckets of up to N points (default 1).
+//      --split S       where the nodes are split (splitPolicies.hpp):
+//                          statistic  the median along the axis chosen by a statistic, prompted for (default)
+//                          widest     the median along the axis of the widest extent
+//                          midpoint   the middle of the widest extent, slid to the nearest point (sliding midpoint)
+//      --sample N      chooses the splitting axis of a node with more than N points from N of its points, drawn at random
+//                      (default: from all the points).
 //
 //  Alternatively, by typing '1' at the prompt, the sample_data.csv can be loaded to train the model.
 //
@@ -13,23 +24,65 @@
 #include "KdNode.hpp"
 #include "CSVTable.hpp"
 #include "QueryTable.hpp"
+#include "parallel.hpp"
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
 
 using std::vector;
 using std::cout;
 using std::endl;
 using std::cin;
 
+// Builds the tree of the points of trainTable, asks whether to print it, and saves it.
+// D is the dimension of the points, fixed at compile time so that the loops over the axes are unrolled, or 0 (any dimension).
+// The values of trainTable are moved to a table of that dimension.
+template<int D>
+void buildAndSave(CSVTable<float> & trainTable, const std::string & split, float bound, int rule, int leafSize, int numThreads,
+                  int sampleSize, const char* modelFileName, bool embedPoints){
+    
+    int input;
+    typedef KdTree<float, CSVTable<float, D>> Tree;
+    CSVTable <float, D> trainPoints(std::move(trainTable)); // the values are moved, not copied
+    std::unique_ptr<Tree> trainTree;
+    if (split == "widest"){
+        cout<<"... Splitting at the median of the widest extent ..." <<endl;
+        trainTree.reset(new Tree(&trainPoints, bound, splitPolicy::WidestExtent(), leafSize, numThreads, sampleSize));
+    }
+    else if (split == "midpoint"){
+        cout<<"... Splitting at the sliding midpoint of the widest extent ..." <<endl;
+        trainTree.reset(new Tree(&trainPoints, bound, splitPolicy::SlidingMidpoint(), leafSize, numThreads, sampleSize));
+    }
+    else
+        trainTree.reset(new Tree(&trainPoints, bound, rule, leafSize, numThreads, sampleSize));
+    cout<<"... Finished building K-d Tree ..."<<endl;
+    cout<<"... To print the tree, press 1. Otherwise, press any keys ..."<<endl;
+    cin >> input;
+    if(input ==1) trainTree->printTree();
+        
+    // Store KdTree
+    cout<<"------------------------------------------------------------"<<endl;
+    cout << "... Saving the K-d Tree ..."<< endl;
+    if (embedPoints) cout << "... The points are embedded in the model ..." << endl;
+    trainTree->save(modelFileName, embedPoints);
+}
+
 int main(int argc, const char * argv[]) {
     
     const char* fileName;
     const char* modelFileName;
     int input;
     float bound;
-    int rule;
+    int rule = 0;
+    bool embedPoints = false;
+    int leafSize = 1;
+    int numThreads = parallel::defaultThreads();
+    int sampleSize = 0;
+    std::string split = "statistic";
     
     if (argc < 3){
         
@@ -53,9 +106,26 @@ int main(int argc, const char * argv[]) {
             return 1;
         }
     }
-    else if(argc==3){
+    else{
         fileName = argv[1];
         modelFileName = argv[2];
+        for (int i=3; i<argc; i++){
+            if (strcmp(argv[i], "--embed-points") == 0)
+                embedPoints = true;
+            else if (strcmp(argv[i], "--leaf-size") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                leafSize = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--split") == 0 && i+1 < argc
+                     && (strcmp(argv[i+1], "statistic") == 0 || strcmp(argv[i+1], "widest") == 0 || strcmp(argv[i+1], "midpoint") == 0))
+                split = argv[++i];
+            else if (strcmp(argv[i], "--sample") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                sampleSize = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-t") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                numThreads = atoi(argv[++i]);
+            else{
+                cout<< "Unknown option: " << argv[i] <<endl;
+                return 1;
+            }
+        }
         cout<<"------------------------------------------------------------"<<endl;
         cout<< "The train data is loaded from: " << fileName << endl;
         cout<< "The model will be saved at: "<< modelFileName << endl;
@@ -65,7 +135,7 @@ int main(int argc, const char * argv[]) {
     // Load Train data
     cout<<"------------------------------------------------------------"<<endl;
     cout<<"... Loading the train data ..."<<endl;
-    CSVTable <float> trainTable(fileName);
+    CSVTable <float> trainTable(fileName, parallel::defaultThreads());
     
     // Build KdTree
     cout<<"------------------------------------------------------------"<<endl;
@@ -82,40 +152,33 @@ int main(int argc, const char * argv[]) {
         bound = 0.1;
     cout<<"------------------------------------------------------------"<<endl;
     
-    cout<<"Choose the rule to determine the splitting axis." <<endl;
-    cout<<"0: Maximizing Standard Deviation. "<< endl;
-    cout<<"1: Minimizing Skew."<<endl;
-    cout<<"2: Minimizing Kurtosis."<<endl;
-    
-    cin>>rule;
-    if(rule ==1 | rule ==2)
-        cout<< rule << " is selected. "<<endl;
-    else
-        cout << "0 is selected."<<endl;
+    if (split == "statistic"){
+        cout<<"Choose the rule to determine the splitting axis." <<endl;
+        cout<<"0: Maximizing Standard Deviation. "<< endl;
+        cout<<"1: Minimizing Skew."<<endl;
+        cout<<"2: Minimizing Kurtosis."<<endl;
+
+        cin>>rule;
+        if(rule ==1 || rule ==2)
+            cout<< rule << " is selected. "<<endl;
+        else
+            cout << "0 is selected."<<endl;
+    }
     
     
     cout<<"------------------------------------------------------------"<<endl;
     cout<<"... Building K-d Tree ..." <<endl;
-    KdTree <float, CSVTable<float>> trainTree(&trainTable, bound, rule);
-    cout<<"... Finished building K-d Tree ..."<<endl;
-    cout<<"... To print the tree, press 1. Otherwise, press any keys ..."<<endl;
-    cin >> input;
-    if(input ==1) trainTree.printTree(trainTree.getRoot(), &trainTable, 0);
-        
-    // Store KdTree
-    cout<<"------------------------------------------------------------"<<endl;
-    cout << "... Saving the K-d Tree ..."<< endl;
-    std::ofstream fout;
-    fout.open(modelFileName, std::fstream::out |  std::fstream::binary);
-    fout.close();
-    fout.open(modelFileName, std::fstream::out | std::fstream::app | std::fstream::binary);
-    if (fout.is_open()){
-        trainTree.write2CSV(trainTree.getRoot(), fout);
-    }
-    else{
-        throw std::runtime_error("Couldn't open CSV file to write.");
+    if (leafSize > 1) cout << "... The leaves hold up to " << leafSize << " points ..." << endl;
+    if (sampleSize > 0) cout << "... The splitting axes are chosen from samples of " << sampleSize << " points ..." << endl;
+    cout<<"... Building on " << numThreads << " thread(s) ..." <<endl;
+    // The dimensions of the main datasets get their own, unrolled, instantiation; the others the generic one
+    switch (trainTable.dim()){
+        case 2: buildAndSave<2>(trainTable, split, bound, rule, leafSize, numThreads, sampleSize, modelFileName, embedPoints); break;
+        case 3: buildAndSave<3>(trainTable, split, bound, rule, leafSize, numThreads, sampleSize, modelFileName, embedPoints); break;
+        case 4: buildAndSave<4>(trainTable, split, bound, rule, leafSize, numThreads, sampleSize, modelFileName, embedPoints); break;
+        case 8: buildAndSave<8>(trainTable, split, bound, rule, leafSize, numThreads, sampleSize, modelFileName, embedPoints); break;
+        default: buildAndSave<0>(trainTable, split, bound, rule, leafSize, numThreads, sampleSize, modelFileName, embedPoints);
     }
-    fout.close();
     
     cout << "... Done ... " << endl;
     
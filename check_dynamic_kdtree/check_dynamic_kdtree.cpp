@@ -0,0 +1,178 @@
+//  This is the main function for check_dynamic_kdtree
+//
+//  This function checks DynamicKdTree (include/DynamicKdTree.hpp) against a brute-force search.
+//  Random points are inserted into and deleted from the index, in a small buffer so that the buffer is merged
+//  and the trees are rebuilt many times, and every few updates random queries are searched both in the index
+//  and by comparing them to all the points still in it. The ids and the distances found must be the same.
+//  Meanwhile another thread searches the index, as a program serving queries during the updates would.
+//
+//  It gets no argument and returns 0 if every check passed, 1 otherwise (run by ctest).
+//
+//  Copyright © 2016 Serim. All rights reserved.
+//
+//
+#include "DynamicKdTree.hpp"
+#include "CSVTable.hpp"
+#include <vector>
+#include <memory>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+// the points of the index by id, as the brute-force search sees them
+struct Reference{
+    int dim;
+    std::vector<std::vector<float>> points; // by id
+    std::vector<bool> live; // by id
+};
+
+// distance between a query and the point of an id
+float distance(const Reference & reference, const std::vector<float> & query, int id){
+    float sum = 0;
+    for (int j=0; j<reference.dim; j++){
+        float diff = query[j] - reference.points[id][j];
+        sum += diff * diff;
+    }
+    return std::sqrt(sum);
+}
+
+// The k nearest live points of the reference, as (distance, id) nearest first.
+std::vector<std::pair<float, int>> bruteForce(const Reference & reference, const std::vector<float> & query, int k){
+    std::vector<std::pair<float, int>> all;
+    for (size_t id=0; id<reference.points.size(); id++){
+        if (reference.live[id])
+            all.push_back(std::make_pair(distance(reference, query, static_cast<int>(id)), static_cast<int>(id)));
+    }
+    size_t n = std::min(all.size(), static_cast<size_t>(k));
+    std::partial_sort(all.begin(), all.begin() + n, all.end());
+    all.resize(n);
+    return all;
+}
+
+// Searches random queries in the index and by brute force. Returns the number of queries whose results differ.
+int compare(const DynamicKdTree<float> & index, const Reference & reference, std::mt19937 & random, int numQueries, int k){
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<float> query(reference.dim);
+    std::vector<int32_t> ids(k);
+    std::vector<float> distances(k);
+    int failures = 0;
+    for (int q=0; q<numQueries; q++){
+        for (int j=0; j<reference.dim; j++)
+            query[j] = uniform(random);
+        std::vector<std::pair<float, int>> expected = bruteForce(reference, query, k);
+        int n = index.knnSearch(RowView<float>(query), k, ids.data(), distances.data());
+        bool same = n == static_cast<int>(expected.size());
+        for (int i=0; same && i<n; i++){
+            // the distance of every rank must match; a tie may be broken either way, but the id must be
+            // a live point at that distance
+            same = std::abs(distances[i] - expected[i].first) <= 1e-5f * std::max(1.0f, expected[i].first)
+                && ids[i] >= 0 && ids[i] < static_cast<int>(reference.points.size()) && reference.live[ids[i]]
+                && (ids[i] == expected[i].second
+                    || std::abs(distance(reference, query, ids[i]) - distances[i]) <= 1e-5f * std::max(1.0f, distances[i]));
+        }
+        if (!same)
+            failures++;
+    }
+    return failures;
+}
+
+// Inserts and deletes points at random, checking the searches along the way. Returns the number of failed checks.
+int checkUpdates(int dim, int initialSize, int bufferSize, int leafSize, unsigned seed){
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    Reference reference;
+    reference.dim = dim;
+
+    std::vector<float> initialValues;
+    for (int i=0; i<initialSize; i++){
+        std::vector<float> point(dim);
+        for (int j=0; j<dim; j++)
+            point[j] = uniform(random);
+        initialValues.insert(initialValues.end(), point.begin(), point.end());
+        reference.points.push_back(point);
+        reference.live.push_back(true);
+    }
+    std::unique_ptr<DynamicKdTree<float>> indexPtr;
+    if (initialSize > 0){
+        CSVTable<float> initial;
+        initial.assign(initialValues.data(), initialSize, dim);
+        indexPtr.reset(new DynamicKdTree<float>(initial, bufferSize, leafSize));
+    }
+    else
+        indexPtr.reset(new DynamicKdTree<float>(dim, bufferSize, leafSize));
+    DynamicKdTree<float> & index = *indexPtr;
+
+    // a reader searches while the index is updated: its results must be sorted and list no id twice
+    std::atomic<bool> done(false);
+    std::atomic<int> readerFailures(0);
+    std::thread reader([&](){
+        std::mt19937 readerRandom(seed + 1);
+        std::uniform_real_distribution<float> readerUniform(0, 1);
+        std::vector<float> query(dim);
+        std::vector<int32_t> ids(8);
+        std::vector<float> distances(8);
+        while (!done){
+            for (int j=0; j<dim; j++)
+                query[j] = readerUniform(readerRandom);
+            int n = index.knnSearch(RowView<float>(query), 8, ids.data(), distances.data());
+            for (int i=1; i<n; i++){
+                if (distances[i] < distances[i-1] || std::find(ids.begin(), ids.begin() + i, ids[i]) != ids.begin() + i)
+                    readerFailures++;
+            }
+        }
+    });
+
+    int failures = 0;
+    for (int step=0; step<3000; step++){
+        bool insert = reference.points.empty() || uniform(random) < 0.65f;
+        if (insert){
+            std::vector<float> point(dim);
+            for (int j=0; j<dim; j++)
+                point[j] = uniform(random);
+            int id = index.insert(RowView<float>(point));
+            if (id != static_cast<int>(reference.points.size()))
+                failures++;
+            reference.points.push_back(point);
+            reference.live.push_back(true);
+        }
+        else{
+            int id = static_cast<int>(uniform(random) * reference.points.size()) % static_cast<int>(reference.points.size());
+            if (index.remove(id) != reference.live[id])
+                failures++;
+            reference.live[id] = false;
+        }
+        if (step % 100 == 99){
+            if (index.size() != static_cast<int>(std::count(reference.live.begin(), reference.live.end(), true)))
+                failures++;
+            failures += compare(index, reference, random, 20, 1);
+            failures += compare(index, reference, random, 20, 10);
+        }
+    }
+    if (index.remove(-1) || index.remove(static_cast<int>(reference.points.size())))
+        failures++;
+    done = true;
+    reader.join();
+    return failures + readerFailures;
+}
+
+int main() {
+
+    int failures = 0;
+    failures += checkUpdates(3, 0, 16, 1, 1);
+    failures += checkUpdates(3, 0, 16, 8, 2);
+    failures += checkUpdates(3, 500, 32, 16, 3);
+    failures += checkUpdates(8, 200, 8, 4, 4);
+    if (failures > 0){
+        cout << "... DynamicKdTree: " << failures << " check(s) failed ..." << endl;
+        return 1;
+    }
+    cout << "... DynamicKdTree: all checks passed ..." << endl;
+    return 0;
+}
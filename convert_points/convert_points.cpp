@@ -0,0 +1,59 @@
+//  This is the main function for convert_points
+//
+//  This function converts a data file between the .csv layout and the binary point file layout.
+//  It gets two arguments from the console:
+//      (1) The absolute path to the input data (.csv or binary point file)
+//      (2) The absolute path to save the converted data
+//
+//  A .csv input is saved as a binary point file, and a binary point file is saved as .csv.
+//  Binary point files can be given to build_kdtree and query_kdtree instead of .csv files.
+//
+//  Copyright © 2016 Serim. All rights reserved.
+//
+//
+#include "CSVTable.hpp"
+#include "parallel.hpp"
+#include "binaryFormat.hpp"
+#include <fstream>
+#include <string>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+int main(int argc, const char * argv[]) {
+
+    if (argc < 3){
+        cout<< "---------------- Arguments are missing  --------------------" <<endl;
+        cout<< "Please provide 2 arguments: "<<endl;
+        cout<< "(1) The absolute path to the input data (.csv or binary)" <<endl;
+        cout<< "(2) The absolute path to save the converted data." <<endl;
+        return 1;
+    }
+    const char* inFileName = argv[1];
+    const char* outFileName = argv[2];
+
+    cout<<"------------------------------------------------------------"<<endl;
+    cout<<"... Loading the data from: "<< inFileName << " ..."<<endl;
+    CSVTable <float> table(inFileName, parallel::defaultThreads());
+    cout<<"... " << table.size() << " points of dimension " << table.dim() << " ..."<<endl;
+
+    if (binaryFormat::fileHasMagic(inFileName, binaryFormat::pointMagic)){
+        cout<<"... Saving as .csv at: "<< outFileName << " ..."<<endl;
+        std::ofstream fout(outFileName, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        if (fout.is_open()){
+            table.write2CSV(fout);
+        }
+        else{
+            throw std::runtime_error("Couldn't open CSV file to write.");
+        }
+        fout.close();
+    }
+    else{
+        cout<<"... Saving as binary point file at: "<< outFileName << " ..."<<endl;
+        table.writeBinary(outFileName);
+    }
+
+    cout << "... Done ... " << endl;
+    return 0;
+}
@@ -0,0 +1,72 @@
+//
+//  AlignedAllocator.hpp
+//
+//  Minimal allocator that hands out memory aligned to a fixed boundary (64 bytes by default,
+//  i.e. one cache line and one AVX-512 register).
+//  Used by CSVTable so that the contiguous point buffer always starts on a cache line.
+//
+//  e.g. vector<float, AlignedAllocator<float>> buffer;
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef AlignedAllocator_hpp
+#define AlignedAllocator_hpp
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+template <typename T, std::size_t Align = 64>
+class AlignedAllocator{
+
+public:
+
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind{ typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator(){}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align> &){}
+
+    T* allocate(std::size_t n); // allocates n elements aligned to Align bytes
+    void deallocate(T* p, std::size_t n); // releases memory obtained by allocate
+};
+
+// allocates n elements aligned to Align bytes
+template <typename T, std::size_t Align>
+T* AlignedAllocator<T, Align>::allocate(std::size_t n){
+    if (n == 0)
+        return nullptr;
+    void* p = nullptr;
+    if (posix_memalign(&p, Align, n * sizeof(T)) != 0)
+        throw std::bad_alloc();
+    return static_cast<T*>(p);
+}
+
+// releases memory obtained by allocate
+template <typename T, std::size_t Align>
+void AlignedAllocator<T, Align>::deallocate(T* p, std::size_t){
+    free(p);
+}
+
+template <typename T, typename U, std::size_t Align>
+bool operator==(const AlignedAllocator<T, Align> &, const AlignedAllocator<U, Align> &){
+    return true;
+}
+
+template <typename T, typename U, std::size_t Align>
+bool operator!=(const AlignedAllocator<T, Align> &, const AlignedAllocator<U, Align> &){
+    return false;
+}
+
+#endif /* AlignedAllocator_hpp */
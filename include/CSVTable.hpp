@@ -7,6 +7,25 @@
 
 //  Train data and test data are initalized as CSVTable objects.
 //
+//  All points are kept in one contiguous, 64-byte aligned buffer in row-major order,
+//  so the k-th value of the i-th point is at buffer[i*K + k].
+//  A column-major mirror can be built on request (buildColumnMajor()) for column scans.
+//
+//  Rows and columns can be accessed without copying through RowView and ColView (TableView.hpp).
+//
+//  With D > 0, the points have D values, known at compile time: dim() is a constant, so the loops over the axes
+//  of a point (e.g. the distances in KdTree) are unrolled by the compiler. Loading data of another dimension
+//  throws. CSVTable<T> (D = 0) takes the dimension of the data. A table can be moved into a table of fixed
+//  dimension without copying the values, e.g. once its dimension is known.
+//
+//  The .csv file is mapped into memory (MappedFile.hpp) and parsed in place (csvParser.hpp),
+//  optionally on several threads.
+//
+//  A table can also be stored as a binary point file (binaryFormat.hpp) via writeBinary(...).
+//  loadBinary(...) maps such a file and uses its values in place: loading takes constant time
+//  and the pages are read from disk when they are first accessed.
+//  The file-path constructor and load(...) detect the format from the first bytes of the file.
+//
 //
 //  Copyright © 2016 Serim Park . All rights reserved.
 
@@ -16,32 +35,62 @@
 
 #include <stdio.h>
 #include <fstream>
+#include <memory>
 #include <vector>
 #include <deque>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <stdexcept>
 #include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+
+#include "AlignedAllocator.hpp"
+#include "TableView.hpp"
+#include "MappedFile.hpp"
+#include "csvParser.hpp"
+#include "parallel.hpp"
+#include "binaryFormat.hpp"
 
 using std::vector;
 using std::deque;
 
 
-template <typename T>
+template <typename T, int D = 0>
 class CSVTable{
     
 public:
     
+    static const int fixedDim = D; // the dimension of the points if fixed at compile time, 0 otherwise
+    
     CSVTable(); // constructor
-    CSVTable(const std::string & fileName); // loads data directly from constructor
+    CSVTable(const std::string & fileName, int numThreads = 1); // loads data directly from constructor
+    template<int E> explicit CSVTable(CSVTable<T, E> && other); // takes the values of other (of the same dimension)
     ~CSVTable(); // destructor
     
-    void loadCSV(const std::string & fileName); // loads data via function call
+    void load(const std::string & fileName, int numThreads = 1); // loads a .csv or a binary point file
+    void loadCSV(const std::string & fileName, int numThreads = 1); // loads data via function call
+    void loadBinary(const std::string & fileName); // maps a binary point file
+    void attach(std::shared_ptr<MappedFile> file, size_t offset, int rows, int cols, uint32_t elemType); // uses values of a mapped file
+    template<int E> void gather(const CSVTable<T, E> & source, const int32_t* order, int n); // copies the rows of source in the given order
+    void assign(const T* values, int rows, int cols); // copies rows x cols values, row by row
+    void writeBinary(const std::string & fileName) const; // saves the table as a binary point file
+    void write2CSV(std::ofstream &fout) const; // saves the table as .csv
     
     T get(int ind, int axis) const; // accessor for a single element
-    vector<T> get(int ind) const; // accessor for a row
-    deque<T> get (const vector<int> &ind, int axis) const; //accessor a column
+    vector<T> get(int ind) const; // accessor for a row (copy)
+    deque<T> get (const vector<int> &ind, int axis) const; //accessor a column (copy)
+    
+    RowView<T> row(int ind) const; // view of a row, no copy
+    ColView<T> col(int axis) const; // view of a column, no copy
+    const T* data() const; // the row-major buffer
+    bool isMapped() const; // whether the values are used in place from a mapped binary file
+    
+    void buildColumnMajor(); // builds the column-major mirror of the table
+    bool hasColumnMajor() const; // whether the column-major mirror exists
     
     void printTable() const; // print the table to the console
     int size() const; // returns number of row of the Table
@@ -49,125 +98,347 @@ public:
     
     
 private:
-    deque<vector<T>> csvTable;
+    template<typename, int> friend class CSVTable;
+    
+    void clear(); // empties the table
+    void setShape(int rows, int cols); // sets the size, checking the dimension if it is fixed
+    
+    vector<T, AlignedAllocator<T>> rowMajor; // numRow x numCol values, row by row
+    std::shared_ptr<MappedFile> mapping; // the mapped binary file, when the values are used in place
+    const T* mapped = nullptr; // first value in the mapped file
+    vector<T, AlignedAllocator<T>> colMajor; // numCol x numRow values, column by column. Empty unless built.
     int numCol;
     int numRow;
 };
 
 // default constructor
-template<typename T>
-CSVTable<T>::CSVTable(){
+template<typename T, int D>
+CSVTable<T, D>::CSVTable(){
     numCol = 0;
     numRow = 0;
 }
 
+// takes the values of other, which is left empty. Throws if the dimensions differ.
+template<typename T, int D>
+template<int E>
+CSVTable<T, D>::CSVTable(CSVTable<T, E> && other){
+    
+    numCol = 0;
+    numRow = 0;
+    setShape(other.numRow, other.numCol);
+    rowMajor = std::move(other.rowMajor);
+    mapping = std::move(other.mapping);
+    mapped = other.mapped;
+    colMajor = std::move(other.colMajor);
+    other.clear();
+}
+
 // default destructor
-template<typename T>
-CSVTable<T>::~CSVTable(){
+template<typename T, int D>
+CSVTable<T, D>::~CSVTable(){
     
 }
 
 // constructor: loads CSV
-template<typename T>
-CSVTable<T>::CSVTable(const std::string & fileName){
-    
-    std::ifstream fin(fileName.c_str());
-    vector<T> values;
-    std::string item;
-    
-    if (fin.fail())
-        throw fileName;
-    
-    for (std::string line; getline(fin, line); )
-    {
-        std::istringstream in(line);
-        
-        while (getline(in, item, ','))
-        {
-            values.push_back(atof(item.c_str()));
-        }
-        csvTable.push_back(values);
-        values.clear();
-        
-    }
-    numRow = static_cast<int>(csvTable.size());
-    numCol = static_cast<int>(csvTable[0].size());
+template<typename T, int D>
+CSVTable<T, D>::CSVTable(const std::string & fileName, int numThreads){
+    
+    numCol = 0;
+    numRow = 0;
+    load(fileName, numThreads);
+}
+
+// loads either a binary point file or a .csv file, depending on the first bytes of the file.
+template<typename T, int D>
+void CSVTable<T, D>::load(const std::string & fileName, int numThreads){
     
+    if (binaryFormat::fileHasMagic(fileName, binaryFormat::pointMagic))
+        loadBinary(fileName);
+    else
+        loadCSV(fileName, numThreads);
 }
 
 // function that loads CSV
-template<typename T>
-void CSVTable<T>::loadCSV(const std::string & fileName){
-    
-    std::ifstream fin(fileName.c_str());
-    vector<T> values;
-    std::string item;
-    
-    if (fin.fail())
-        throw fileName;
-    
-    for (std::string line; getline(fin, line); )
-    {
-        std::istringstream in(line);
-        
-        while (getline(in, item, ','))
-        {
-            values.push_back(atof(item.c_str()));
+// The file is mapped into memory and parsed in two passes:
+//      (1) the rows and columns are counted, and the buffer is allocated once,
+//      (2) the values are parsed in place into the buffer.
+// With numThreads > 1, the file is cut into chunks at line boundaries and both passes run
+// on the chunks concurrently. Each chunk is parsed directly to its final position in the buffer,
+// so the rows keep the order of the file.
+// Every row must have the same number of values as the first one.
+// A malformed row is reported with its line number (std::runtime_error).
+template<typename T, int D>
+void CSVTable<T, D>::loadCSV(const std::string & fileName, int numThreads){
+    
+    MappedFile file;
+    if (!file.open(fileName))
+        throw std::runtime_error("Couldn't open file to load: " + fileName);
+    file.adviseSequential();
+    
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    
+    // no point in splitting small files
+    const size_t minChunkSize = 1 << 20;
+    int numChunks = std::max(1, std::min(numThreads, static_cast<int>(file.size() / minChunkSize)));
+    vector<const char*> bounds = csvParser::splitLines(begin, end, numChunks);
+    
+    // pass 1: rows and lines per chunk
+    vector<long> rowStart(numChunks + 1, 0);
+    vector<long> lineStart(numChunks + 1, 0);
+    parallel::forEach(numChunks, numThreads, [&](int c){
+        rowStart[c+1] = csvParser::countRows(bounds[c], bounds[c+1], &lineStart[c+1]);
+    });
+    for (int c = 0; c < numChunks; c++){
+        rowStart[c+1] += rowStart[c];
+        lineStart[c+1] += lineStart[c];
+    }
+    
+    clear();
+    setShape(static_cast<int>(rowStart[numChunks]), csvParser::countColumns(begin, end));
+    rowMajor.resize(static_cast<size_t>(numRow) * numCol);
+    
+    // pass 2: values, each chunk at its own rows
+    T* out = rowMajor.data();
+    int cols = numCol;
+    parallel::forEach(numChunks, numThreads, [&](int c){
+        csvParser::parseRows(bounds[c], bounds[c+1], cols, out + rowStart[c] * cols, lineStart[c] + 1, fileName);
+    });
+    
+}
+
+// maps a binary point file.
+// If the file holds values of type T, they are used in place (no copy, pages are read lazily).
+// Otherwise (e.g. double values for a float table) they are converted into the table's own buffer.
+template<typename T, int D>
+void CSVTable<T, D>::loadBinary(const std::string & fileName){
+    
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(fileName))
+        throw std::runtime_error("Couldn't open file to load: " + fileName);
+    
+    binaryFormat::PointFileHeader header;
+    if (file->size() < sizeof(header) || !binaryFormat::hasMagic(file->data(), file->size(), binaryFormat::pointMagic))
+        throw std::runtime_error(fileName + ": not a binary point file");
+    memcpy(&header, file->data(), sizeof(header));
+    if (header.version != binaryFormat::pointVersion)
+        throw std::runtime_error(fileName + ": unsupported point file version " + std::to_string(header.version));
+    size_t elemSize = binaryFormat::elementSize(header.elemType);
+    if (elemSize == 0)
+        throw std::runtime_error(fileName + ": unknown element type " + std::to_string(header.elemType));
+    if (header.rows > static_cast<uint64_t>(std::numeric_limits<int>::max())
+        || header.dims > static_cast<uint64_t>(std::numeric_limits<int>::max()) || (header.dims == 0 && header.rows > 0))
+        throw std::runtime_error(fileName + ": invalid shape " + std::to_string(header.rows) + " x " + std::to_string(header.dims));
+    if (!binaryFormat::fitsInFile(file->size(), header.dataOffset, header.rows, header.dims * elemSize))
+        throw std::runtime_error(fileName + ": truncated point file");
+    
+    attach(file, header.dataOffset, static_cast<int>(header.rows), static_cast<int>(header.dims), header.elemType);
+}
+
+// uses rows x cols values stored at offset in a mapped file (e.g. a point file or a model file).
+// If they are of type T, they are used in place. Otherwise they are converted into the table's own buffer.
+template<typename T, int D>
+void CSVTable<T, D>::attach(std::shared_ptr<MappedFile> file, size_t offset, int rows, int cols, uint32_t elemType){
+    
+    clear();
+    setShape(rows, cols);
+    const char* values = file->data() + offset;
+    size_t elemSize = binaryFormat::elementSize(elemType);
+    
+    if (elemType == binaryFormat::elementType<T>() && offset % alignof(T) == 0){
+        mapping = file;
+        mapped = reinterpret_cast<const T*>(values);
+    }
+    else{
+        rowMajor.resize(static_cast<size_t>(numRow) * numCol);
+        for (size_t i = 0; i < rowMajor.size(); i++){
+            if (elemType == binaryFormat::float32){
+                float v;
+                memcpy(&v, values + i * elemSize, elemSize);
+                rowMajor[i] = static_cast<T>(v);
+            }
+            else{
+                double v;
+                memcpy(&v, values + i * elemSize, elemSize);
+                rowMajor[i] = static_cast<T>(v);
+            }
         }
-        csvTable.push_back(values);
-        values.clear();
-        
     }
-    numRow = static_cast<int>(csvTable.size());
-    numCol = static_cast<int>(csvTable[0].size());
+}
+
+// copies n rows of source in the given order: row i of this table is row order[i] of source.
+template<typename T, int D>
+template<int E>
+void CSVTable<T, D>::gather(const CSVTable<T, E> & source, const int32_t* order, int n){
     
+    clear();
+    setShape(n, source.dim());
+    rowMajor.resize(static_cast<size_t>(numRow) * numCol);
+    for (int i=0; i<numRow; i++){
+        RowView<T> src = source.row(order[i]);
+        std::copy(src.begin(), src.end(), rowMajor.begin() + static_cast<size_t>(i) * numCol);
+    }
 }
 
+// copies rows x cols values, given row by row.
+template<typename T, int D>
+void CSVTable<T, D>::assign(const T* values, int rows, int cols){
+    
+    clear();
+    setShape(rows, cols);
+    rowMajor.assign(values, values + static_cast<size_t>(rows) * cols);
+}
+
+// saves the table as a binary point file: the header, followed by the values at a 64-byte aligned offset.
+template<typename T, int D>
+void CSVTable<T, D>::writeBinary(const std::string & fileName) const{
+    
+    binaryFormat::PointFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, binaryFormat::pointMagic, 8);
+    header.version = binaryFormat::pointVersion;
+    header.elemType = binaryFormat::elementType<T>();
+    header.rows = static_cast<uint64_t>(numRow);
+    header.dims = static_cast<uint64_t>(numCol);
+    header.alignment = 64;
+    header.dataOffset = binaryFormat::alignUp(sizeof(header), header.alignment);
+    
+    std::ofstream fout(fileName.c_str(), std::fstream::out | std::fstream::binary | std::fstream::trunc);
+    if (!fout.is_open())
+        throw std::runtime_error("Couldn't open file to write: " + fileName);
+    vector<char> padding(header.dataOffset - sizeof(header), 0);
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fout.write(padding.data(), padding.size());
+    fout.write(reinterpret_cast<const char*>(data()), static_cast<std::streamsize>(sizeof(T) * numRow * numCol));
+    if (!fout)
+        throw std::runtime_error("Couldn't write file: " + fileName);
+}
+
+// saves the table as .csv, one point per line
+template<typename T, int D>
+void CSVTable<T, D>::write2CSV(std::ofstream &fout) const{
+    fout << std::setprecision(std::numeric_limits<T>::max_digits10);
+    for (int i=0; i<numRow; i++){
+        for (int j=0; j<numCol; j++){
+            fout << get(i, j);
+            if (j < numCol-1) fout << ",";
+        }
+        fout << "\n";
+    }
+    fout.flush();
+}
+
+// empties the table
+template<typename T, int D>
+void CSVTable<T, D>::clear(){
+    rowMajor.clear();
+    colMajor.clear();
+    mapping.reset();
+    mapped = nullptr;
+    numRow = 0;
+    numCol = 0;
+}
+
+// sets the number of rows and columns. With a fixed dimension, a table with rows must have D columns.
+template<typename T, int D>
+void CSVTable<T, D>::setShape(int rows, int cols){
+    if (D > 0 && cols != D && rows > 0)
+        throw std::runtime_error("The points have " + std::to_string(cols) + " values, expected " + std::to_string(D) + ".");
+    numRow = rows;
+    numCol = cols;
+}
+
+// builds the column-major mirror of the table.
+// Afterwards col(axis) returns contiguous views.
+template<typename T, int D>
+void CSVTable<T, D>::buildColumnMajor(){
+    colMajor.resize(static_cast<size_t>(numRow) * numCol);
+    const T* values = data();
+    for(int i=0; i<numRow; i++){
+        for(int j=0; j<numCol; j++){
+            colMajor[static_cast<size_t>(j)*numRow + i] = values[static_cast<size_t>(i)*numCol + j];
+        }
+    }
+}
+
+// whether the column-major mirror exists
+template<typename T, int D>
+bool CSVTable<T, D>::hasColumnMajor() const{
+    return !colMajor.empty() || numRow == 0;
+}
 
 // accessor for single element of a CSVTable
-template<typename T>
-T CSVTable<T>::get(int ind, int axis) const{
-    return csvTable[ind][axis];
+template<typename T, int D>
+T CSVTable<T, D>::get(int ind, int axis) const{
+    return data()[static_cast<size_t>(ind)*dim() + axis];
 }
 
 // accessor for a row of a CSVTable
-template<typename T>
-vector<T> CSVTable<T>::get(int ind) const{
-    return csvTable[ind];
+template<typename T, int D>
+vector<T> CSVTable<T, D>::get(int ind) const{
+    return row(ind).toVector();
 }
 
 //accessor for a column of a CSVTable
-template<typename T>
-deque<T> CSVTable<T>::get(const vector<int> &ind, int axis) const{
+template<typename T, int D>
+deque<T> CSVTable<T, D>::get(const vector<int> &ind, int axis) const{
     deque<T> col(ind.size());
+    ColView<T> column = this->col(axis);
     for (int i=0; i<ind.size(); i++){
-        col[i]=(csvTable[ind[i]][axis]);
+        col[i]=column[ind[i]];
     }
     return col;
 }
 
-template<typename T>
-void CSVTable<T>::printTable() const{
+// view of a row of a CSVTable
+template<typename T, int D>
+RowView<T> CSVTable<T, D>::row(int ind) const{
+    return RowView<T>(data() + static_cast<size_t>(ind)*dim(), dim());
+}
+
+// view of a column of a CSVTable.
+// Contiguous if the column-major mirror exists, strided otherwise.
+template<typename T, int D>
+ColView<T> CSVTable<T, D>::col(int axis) const{
+    if (!colMajor.empty())
+        return ColView<T>(colMajor.data() + static_cast<size_t>(axis)*numRow, numRow, 1);
+    return ColView<T>(data() + axis, numRow, numCol);
+}
+
+// the row-major buffer (the mapped file, or the table's own buffer)
+template<typename T, int D>
+const T* CSVTable<T, D>::data() const{
+    return mapped ? mapped : rowMajor.data();
+}
+
+// whether the values are used in place from a mapped binary file
+template<typename T, int D>
+bool CSVTable<T, D>::isMapped() const{
+    return mapped != nullptr;
+}
+
+template<typename T, int D>
+void CSVTable<T, D>::printTable() const{
     for(int i=0; i < numRow; i++){
         std::cout<<"data"<<i<<": (";
         for(int j=0; j<numCol; j++){
-            std::cout << csvTable.at(i).at(j);
+            std::cout << get(i, j);
             if(j<numCol-1) std::cout <<",";
         }
         std::cout<<")"<<std::endl;
     }
 }
 
-// returns the number of columns (number of features)
-template<typename T>
-int CSVTable<T>::dim() const{
-    return numCol;
+// returns the number of columns (number of features), a constant if the dimension is fixed
+template<typename T, int D>
+int CSVTable<T, D>::dim() const{
+    return D > 0 ? D : numCol;
 }
 
 // returns the number of rows (number of samples)
-template<typename T>
-int CSVTable<T>::size() const{
+template<typename T, int D>
+int CSVTable<T, D>::size() const{
     return numRow;
 }
 
-#endif /* CSVTable_hpp */
\ No newline at end of file
+#endif /* CSVTable_hpp */
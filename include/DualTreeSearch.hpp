@@ -0,0 +1,385 @@
+//
+//  DualTreeSearch.hpp
+//
+//  DualTreeSearch finds the k nearest points in a reference tree of every point of a query tree at once
+//  (all-nearest-neighbours), by traversing the two trees together.
+//
+//  Searching the queries one by one repeats nearly the same descent for queries that are close to each other.
+//  Here the queries are a KdTree too, and the search visits pairs (query node, reference node):
+//      - every node has the bounding box of the points of its subtree (computed once, from the leaves up),
+//      - a pair is pruned when the two boxes are farther apart than the k-th distance so far of the worst
+//        query of the query node (its bound): no reference point of the pair can be nearer to any of its queries.
+//        One test discards a whole block of queries against a whole subtree of reference points.
+//      - otherwise both are split into their parts (the split point of the node and its children), and every
+//        query part visits the reference parts nearest first, so that its bound tightens early. Once both are
+//        a single block of points (a bucket, or the split point of an inner node), all their pairs of points
+//        are compared (base case).
+//      - the bound of a query node is the largest bound of its parts, updated once they are searched.
+//      - before the traversal, the block of every query node is compared to the reference leaf where its center falls
+//        (prime(...)), so that the bounds are tight from the first pairs on.
+//  A query then meets about as many reference leaves as in knnSearch(...), but the descents are shared
+//  by the queries of a block: with as many queries as reference points (e.g. matching or deduplicating a data set
+//  against itself), the total cost grows nearly linearly instead of one descent per query.
+//  This pays off in low dimensions. In more than a few, the boxes of the query blocks are large compared to the
+//  distances to the neighbours, so many more pairs pass the test and knnSearch(...) is faster.
+//
+//  The search is exact, or (1+epsilon)-approximate with the epsilon of the reference tree (see KdTree.hpp):
+//  the distances between boxes are then multiplied by (1+epsilon)^2. The traversal has no equivalent of the bound
+//  or of the maximum number of checks, so search(...) throws if the reference tree is in boundedSearch or has
+//  a maximum number of checks, instead of ignoring them. Every query thus gets its k points.
+//  Equal distances are ordered by indice (KnnHeap.hpp), as in knnSearch(...).
+//
+//  The candidates of every query are kept in their own KnnHeap. The query tree is cut into subtrees that
+//  search the whole reference tree independently, claimed by the threads one after the other (parallel.hpp).
+//  The bounding boxes take 2 x dim values per node of each tree: trees with buckets (leaf size 8 to 64) have far fewer nodes.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef DualTreeSearch_hpp
+#define DualTreeSearch_hpp
+
+#include "KdTree.hpp"
+#include "KnnHeap.hpp"
+#include "distanceKernels.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+
+template <typename T, class CSVTable>
+class DualTreeSearch{
+
+public:
+
+    DualTreeSearch(const KdTree<T, CSVTable> & queryTree, const KdTree<T, CSVTable> & referenceTree);
+
+    // finds the k nearest reference points of every query point, on up to numThreads threads.
+    // The results of the query of indice i (in the query tree's data) go to indices[i*k ... i*k+k-1] and
+    // distances[i*k ...], nearest first. k must not exceed the number of reference points.
+    void search(int k, int32_t* indices, T* distances, int numThreads = 1);
+    int64_t pairsVisited() const { return visitedPairs; } // number of pairs of nodes visited by the latest search
+
+private:
+    // a part of a tree: the subtree of the node at pos, or only the node's own points (own)
+    struct Unit{
+        int pos;
+        bool own;
+    };
+    // the bounding boxes of the subtrees of a tree, and the row after the last point of every subtree
+    struct Boxes{
+        std::vector<T> lower;
+        std::vector<T> upper;
+        std::vector<int> end;
+    };
+
+    static void computeBoxes(const KdTree<T, CSVTable> & tree, Boxes & boxes);
+    static bool isBlock(const KdTree<T, CSVTable> & tree, const Unit & unit);
+    static int firstRow(const KdTree<T, CSVTable> & tree, const Unit & unit);
+    static int endRow(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit);
+    static const T* lowerOf(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit);
+    static const T* upperOf(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit);
+    static int parts(const KdTree<T, CSVTable> & tree, const Unit & unit, Unit* into);
+    T distance(const Unit & query, const Unit & reference) const;
+    T pointDistance(const T* queryPoint, const Unit & reference) const;
+    T boundOf(const Unit & query) const;
+    void traverse(const Unit & query, const Unit & reference, int64_t & visited);
+    void baseCase(const Unit & query, const Unit & reference);
+    void prime(int queryPos);
+
+    const KdTree<T, CSVTable> & queries;
+    const KdTree<T, CSVTable> & references;
+    Boxes queryBoxes;
+    Boxes referenceBoxes;
+    std::vector<KnnHeap<T>> heaps; // the candidates of every row of the query tree
+    std::vector<T> bounds; // the bound of the subtree of every query node, infinity until it is searched
+    std::vector<int> primed; // the reference leaf already compared to the block of every query node (prime(...))
+    T scale = 1; // (1+epsilon)^2
+    int64_t visitedPairs = 0;
+};
+
+// Computes the bounding boxes of both trees.
+template <typename T, class CSVTable>
+DualTreeSearch<T, CSVTable>::DualTreeSearch(const KdTree<T, CSVTable> & queryTree, const KdTree<T, CSVTable> & referenceTree)
+    : queries(queryTree), references(referenceTree){
+    if (queryTree.getPoints().dim() != referenceTree.getPoints().dim() && queryTree.size() > 0 && referenceTree.size() > 0)
+        throw std::runtime_error("The queries have " + std::to_string(queryTree.getPoints().dim()) + " dimensions, the reference points "
+                                 + std::to_string(referenceTree.getPoints().dim()) + ".");
+    computeBoxes(queryTree, queryBoxes);
+    computeBoxes(referenceTree, referenceBoxes);
+}
+
+// The bounding box of every subtree: its own points and the boxes of its children.
+// The children come after their parent in the pool, so one pass from the last node to the first does it.
+template <typename T, class CSVTable>
+void DualTreeSearch<T, CSVTable>::computeBoxes(const KdTree<T, CSVTable> & tree, Boxes & boxes){
+    int numNodes = tree.size();
+    int dims = tree.getPoints().dim();
+    boxes.lower.assign(static_cast<size_t>(numNodes) * dims, std::numeric_limits<T>::infinity());
+    boxes.upper.assign(static_cast<size_t>(numNodes) * dims, -std::numeric_limits<T>::infinity());
+    boxes.end.assign(numNodes, 0);
+    for (int pos=numNodes-1; pos>=0; pos--){
+        const KdNode & node = tree.getNode(pos);
+        T* lower = &boxes.lower[static_cast<size_t>(pos) * dims];
+        T* upper = &boxes.upper[static_cast<size_t>(pos) * dims];
+        for (int row=node.first; row<node.first + node.count; row++){
+            const T* point = tree.getPoints().row(row).data();
+            for (int j=0; j<dims; j++){
+                lower[j] = std::min(lower[j], point[j]);
+                upper[j] = std::max(upper[j], point[j]);
+            }
+        }
+        boxes.end[pos] = node.first + node.count;
+        int children[2] = {node.hasLeft() ? node.leftChild(pos) : -1, node.rightChild()};
+        for (int child : children){
+            if (child < 0)
+                continue;
+            const T* childLower = &boxes.lower[static_cast<size_t>(child) * dims];
+            const T* childUpper = &boxes.upper[static_cast<size_t>(child) * dims];
+            for (int j=0; j<dims; j++){
+                lower[j] = std::min(lower[j], childLower[j]);
+                upper[j] = std::max(upper[j], childUpper[j]);
+            }
+            boxes.end[pos] = std::max(boxes.end[pos], boxes.end[child]);
+        }
+    }
+}
+
+// whether the unit is a single block of points: the own points of a node, or a bucket
+template <typename T, class CSVTable>
+bool DualTreeSearch<T, CSVTable>::isBlock(const KdTree<T, CSVTable> & tree, const Unit & unit){
+    return unit.own || tree.getNode(unit.pos).isLeaf();
+}
+
+// the first row of the points of the unit
+template <typename T, class CSVTable>
+int DualTreeSearch<T, CSVTable>::firstRow(const KdTree<T, CSVTable> & tree, const Unit & unit){
+    return tree.getNode(unit.pos).first;
+}
+
+// the row after the last point of the unit
+template <typename T, class CSVTable>
+int DualTreeSearch<T, CSVTable>::endRow(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit){
+    const KdNode & node = tree.getNode(unit.pos);
+    return isBlock(tree, unit) ? node.first + node.count : boxes.end[unit.pos];
+}
+
+// the lower corner of the bounding box of the unit. The own point of an inner node is its own box.
+template <typename T, class CSVTable>
+const T* DualTreeSearch<T, CSVTable>::lowerOf(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit){
+    const KdNode & node = tree.getNode(unit.pos);
+    if (unit.own && !node.isLeaf())
+        return tree.getPoints().row(node.first).data();
+    return &boxes.lower[static_cast<size_t>(unit.pos) * tree.getPoints().dim()];
+}
+
+// the upper corner of the bounding box of the unit
+template <typename T, class CSVTable>
+const T* DualTreeSearch<T, CSVTable>::upperOf(const KdTree<T, CSVTable> & tree, const Boxes & boxes, const Unit & unit){
+    const KdNode & node = tree.getNode(unit.pos);
+    if (unit.own && !node.isLeaf())
+        return tree.getPoints().row(node.first).data();
+    return &boxes.upper[static_cast<size_t>(unit.pos) * tree.getPoints().dim()];
+}
+
+// The parts of a subtree that is not a block: the node's own point, and its children. Returns their number.
+template <typename T, class CSVTable>
+int DualTreeSearch<T, CSVTable>::parts(const KdTree<T, CSVTable> & tree, const Unit & unit, Unit* into){
+    const KdNode & node = tree.getNode(unit.pos);
+    int n = 0;
+    into[n++] = Unit{unit.pos, true};
+    if (node.hasLeft())
+        into[n++] = Unit{node.leftChild(unit.pos), false};
+    if (node.hasRight())
+        into[n++] = Unit{node.rightChild(), false};
+    return n;
+}
+
+// The squared distance between the bounding boxes of a query unit and a reference unit, scaled by (1+epsilon)^2.
+// No point of the one is nearer to a point of the other.
+template <typename T, class CSVTable>
+T DualTreeSearch<T, CSVTable>::distance(const Unit & query, const Unit & reference) const{
+    const T* queryLower = lowerOf(queries, queryBoxes, query);
+    const T* queryUpper = upperOf(queries, queryBoxes, query);
+    const T* referenceLower = lowerOf(references, referenceBoxes, reference);
+    const T* referenceUpper = upperOf(references, referenceBoxes, reference);
+    T dist = 0;
+    for (int j=0; j<queries.getPoints().dim(); j++){
+        T gap = std::max(std::max(referenceLower[j] - queryUpper[j], queryLower[j] - referenceUpper[j]), T(0));
+        dist += gap * gap;
+    }
+    return dist * scale;
+}
+
+// The bound of a query unit: the largest k-th distance so far of its queries (infinity while one has fewer than k).
+// A reference unit farther than it cannot give a nearer point to any of them.
+template <typename T, class CSVTable>
+T DualTreeSearch<T, CSVTable>::boundOf(const Unit & query) const{
+    if (query.own && !queries.getNode(query.pos).isLeaf())
+        return heaps[queries.getNode(query.pos).first].worst();
+    return bounds[query.pos];
+}
+
+// The squared distance between a query point and the bounding box of a reference unit, scaled by (1+epsilon)^2.
+template <typename T, class CSVTable>
+T DualTreeSearch<T, CSVTable>::pointDistance(const T* queryPoint, const Unit & reference) const{
+    const T* referenceLower = lowerOf(references, referenceBoxes, reference);
+    const T* referenceUpper = upperOf(references, referenceBoxes, reference);
+    T dist = 0;
+    for (int j=0; j<queries.getPoints().dim(); j++){
+        T gap = std::max(std::max(referenceLower[j] - queryPoint[j], queryPoint[j] - referenceUpper[j]), T(0));
+        dist += gap * gap;
+    }
+    return dist * scale;
+}
+
+// Searches the reference unit for the queries of the query unit, whose boxes are within the bound of the query unit.
+// Both units are split into their parts, unless they are blocks. Every query part searches the reference parts
+// within its bound, nearest first, so that its own bound tightens early.
+template <typename T, class CSVTable>
+void DualTreeSearch<T, CSVTable>::traverse(const Unit & query, const Unit & reference, int64_t & visited){
+
+    visited++;
+    bool queryBlock = isBlock(queries, query);
+    bool referenceBlock = isBlock(references, reference);
+    if (queryBlock && referenceBlock){
+        baseCase(query, reference);
+        return;
+    }
+
+    Unit queryParts[3] = {query};
+    Unit referenceParts[3] = {reference};
+    int numQuery = queryBlock ? 1 : parts(queries, query, queryParts);
+    int numReference = referenceBlock ? 1 : parts(references, reference, referenceParts);
+    T newBound = 0;
+    for (int i=0; i<numQuery; i++){
+        Unit order[3];
+        T dist[3];
+        for (int j=0; j<numReference; j++){ // nearest first
+            order[j] = referenceParts[j];
+            dist[j] = distance(queryParts[i], order[j]);
+            for (int m=j; m>0 && dist[m] < dist[m-1]; m--){
+                std::swap(dist[m], dist[m-1]);
+                std::swap(order[m], order[m-1]);
+            }
+        }
+        for (int j=0; j<numReference; j++){
+            if (dist[j] < boundOf(queryParts[i]))
+                traverse(queryParts[i], order[j], visited);
+        }
+        newBound = std::max(newBound, boundOf(queryParts[i]));
+    }
+    if (!queryBlock)
+        bounds[query.pos] = newBound;
+}
+
+// Compares every query point of the query unit to every reference point of the reference unit,
+// the same way as knnSearch(...) does (a bucket with scanLeaf(...)), so the distances are the same.
+// A query skips a bucket farther from it than its own k-th distance so far: the box of a query bucket
+// can be much larger than the distances to the neighbours of its queries, in more than a few dimensions.
+// Updates the bound of a query bucket.
+template <typename T, class CSVTable>
+void DualTreeSearch<T, CSVTable>::baseCase(const Unit & query, const Unit & reference){
+    if (primed[query.pos] == reference.pos)
+        return;
+    int dims = queries.getPoints().dim();
+    const KdNode & node = references.getNode(reference.pos);
+    const T* nodePoint = references.getPoints().row(node.first).data();
+    int queryEnd = endRow(queries, queryBoxes, query);
+    T newBound = 0;
+    for (int queryRow=firstRow(queries, query); queryRow<queryEnd; queryRow++){
+        KnnHeap<T> & found = heaps[queryRow];
+        const RowView<T> queryPoint = queries.getPoints().row(queryRow);
+        if (node.count > 1){
+            if (found.reaches(pointDistance(queryPoint.data(), reference)))
+                references.scanLeaf(node, queryPoint, found);
+        }
+        else
+            found.push(distanceKernels::squaredDim<CSVTable::fixedDim>(queryPoint.data(), nodePoint, dims, found.worst()), references.getId(node.first));
+        newBound = std::max(newBound, found.worst());
+    }
+    if (!query.own || queries.getNode(query.pos).isLeaf())
+        bounds[query.pos] = newBound;
+}
+
+// Gives the queries of the block of a query node their first candidates: the reference leaf where the center
+// of the block falls, found by one descent. The bounds are then tight from the start of the traversal,
+// which otherwise meets the reference nodes in the order that suits the ancestors of the block.
+template <typename T, class CSVTable>
+void DualTreeSearch<T, CSVTable>::prime(int queryPos){
+    Unit query{queryPos, true};
+    const T* lower = lowerOf(queries, queryBoxes, query);
+    const T* upper = upperOf(queries, queryBoxes, query);
+    int pos = 0;
+    while (!references.getNode(pos).isLeaf()){
+        const KdNode & node = references.getNode(pos);
+        int ax = node.splitAxis;
+        T center = (lower[ax] + upper[ax]) / 2;
+        bool goLeft = node.hasLeft() && (center <= references.getPoints().row(node.first).data()[ax] || !node.hasRight());
+        pos = goLeft ? node.leftChild(pos) : node.rightChild();
+    }
+    baseCase(query, Unit{pos, true});
+    primed[queryPos] = pos;
+}
+
+// Finds the k nearest reference points of every query point.
+// The query tree is cut into about 8 subtrees (or own points of the nodes above them) per thread, which are searched
+// against the whole reference tree one after the other by the threads.
+template <typename T, class CSVTable>
+void DualTreeSearch<T, CSVTable>::search(int k, int32_t* indices, T* distances, int numThreads){
+
+    visitedPairs = 0;
+    if (references.getSearchMode() != KdTree<T, CSVTable>::exactSearch || references.getMaxChecks() > 0)
+        throw std::runtime_error("The dual-tree search is exact or (1+epsilon)-approximate: "
+                                 "it does not support boundedSearch or a maximum number of checks.");
+    if (queries.size() == 0 || references.size() == 0 || k <= 0)
+        return;
+    T epsilon = references.getEpsilon();
+    scale = (1 + epsilon) * (1 + epsilon);
+    heaps.assign(queries.numPoints(), KnnHeap<T>(0));
+    for (size_t row=0; row<heaps.size(); row++)
+        heaps[row].reset(k);
+    bounds.assign(queries.size(), std::numeric_limits<T>::infinity());
+    primed.assign(queries.size(), -1);
+    int chunkSize = 1024;
+    parallel::forEach((queries.size() + chunkSize - 1) / chunkSize, std::max(numThreads, 1), [&](int chunk){
+        int end = std::min(queries.size(), (chunk + 1) * chunkSize);
+        for (int pos=chunk * chunkSize; pos<end; pos++)
+            prime(pos);
+    });
+
+    // cut the query tree breadth first: a subtree is replaced by its own points and its children
+    std::vector<Unit> tasks(1, Unit{0, false});
+    numThreads = std::max(numThreads, 1);
+    for (size_t next=0; numThreads > 1 && next < tasks.size() && tasks.size() < static_cast<size_t>(numThreads) * 8; next++){
+        if (isBlock(queries, tasks[next]))
+            continue;
+        Unit split[3];
+        int n = parts(queries, tasks[next], split);
+        tasks[next] = split[0];
+        tasks.insert(tasks.end(), split + 1, split + n);
+    }
+
+    std::atomic<int64_t> visited(0);
+    Unit root{0, false};
+    parallel::forEach(static_cast<int>(tasks.size()), numThreads, [&](int task){
+        int64_t taskVisited = 0;
+        if (distance(tasks[task], root) < boundOf(tasks[task]))
+            traverse(tasks[task], root, taskVisited);
+        visited += taskVisited;
+    });
+    visitedPairs = visited;
+
+    for (int row=0; row<queries.numPoints(); row++){
+        size_t slot = static_cast<size_t>(queries.getId(row)) * k;
+        heaps[row].write(indices + slot, distances + slot);
+    }
+    std::vector<KnnHeap<T>>().swap(heaps);
+}
+
+#endif /* DualTreeSearch_hpp */
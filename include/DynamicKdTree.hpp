@@ -0,0 +1,355 @@
+//
+//  DynamicKdTree.hpp
+//
+//  DynamicKdTree is an index that points can be added to and deleted from, without rebuilding it from scratch.
+//
+//  A KdTree is built once and does not change. DynamicKdTree keeps a few of them (the logarithmic method):
+//      - new points go to a small buffer, which the queries scan point by point,
+//      - when the buffer is full, it becomes a KdTree. The trees are in slots: slot i holds at most
+//        bufferSize x 2^i points. The buffer and the trees of the slots 0, 1, ... up to the first empty slot
+//        that can hold them all are merged into one tree, built in that slot, like a binary counter.
+//        A point is thus rebuilt about log2(n / bufferSize) times over n insertions, and there are at most
+//        that many trees to search.
+//      - a deleted point gets a tombstone: the search skips it. When half the points of a tree are deleted,
+//        the tree is rebuilt from the others in its slot. A point of the buffer is simply removed.
+//  Every point gets an id when it is inserted (0, 1, 2, ... and the rows of the initial table first),
+//  which the searches return in place of an indice. Ids are not reused.
+//
+//  The queries can run on any number of threads while points are added and deleted:
+//      - the buffer and the trees make a snapshot, which never changes once published. A query takes the current
+//        snapshot (std::atomic_load) and searches it; an insertion or a merge publishes a new one (std::atomic_store).
+//        The trees a snapshot shares with the next one are not copied, and a tree is freed once no snapshot uses it.
+//      - a tombstone is an atomic flag of its tree, so deleting a point of a tree does not need a new snapshot.
+//        A query that runs while a point is deleted may or may not return it.
+//      - insertions and deletions are serialized by a mutex. A merge runs on the inserting thread; the queries
+//        meanwhile search the previous snapshot.
+//  Merges are not done in the background: the insertion that fills the buffer builds the merged tree before it
+//  returns, holding the mutex, so that insertion and every other writer wait for the whole rebuild. Most insertions
+//  only append to the buffer, but one in bufferSize x 2^i rebuilds a tree of that size (e.g. about 3.6 s for a merge
+//  into a tree of a million points), and likewise the deletion that rebuilds a half-deleted tree. The queries
+//  are never blocked. A program that cannot stall its writers can insert from a thread of its own.
+//  A query searches all the trees with one KnnHeap (KdTree::collect(...)): the k-th distance found in the larger trees,
+//  searched first, prunes the smaller ones. The search is exact, with the leaf size given to the constructor.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef DynamicKdTree_hpp
+#define DynamicKdTree_hpp
+
+#include "CSVTable.hpp"
+#include "KdTree.hpp"
+#include "KnnHeap.hpp"
+#include "distanceKernels.hpp"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+
+template <typename T>
+class DynamicKdTree{
+
+public:
+
+    DynamicKdTree(int dim, int bufferSize = 256, int leafSize = 16, int numThreads = 1);
+    DynamicKdTree(const CSVTable<T>& initial, int bufferSize = 256, int leafSize = 16, int numThreads = 1);
+
+    int insert(const RowView<T>& point); // adds a point. Returns its id.
+    bool remove(int id); // deletes the point of that id. Returns false if there is none.
+    // finds the k nearest points: ind_dist = id1,dist1,id2,dist2,... nearest first.
+    void knnSearch(const RowView<T>& testPoint, int k, vector<T> & ind_dist) const;
+    // same, into ids[0..k-1] and distances[0..k-1]. Returns the number of points found, min(k, size()).
+    int knnSearch(const RowView<T>& testPoint, int k, int32_t* ids, T* distances) const;
+
+    int size() const; // number of points
+    int dim() const; // number of values per point
+    int numTrees() const; // number of trees of the current snapshot
+
+private:
+    // a tree of one slot
+    struct Level{
+        Level(const CSVTable<T>& points, vector<int32_t> pointIds, int leafSize, int numThreads);
+        KdTree<T, CSVTable<T>> tree;
+        vector<int32_t> ids; // the id of every point, by its indice in the data the tree was built from
+        std::unique_ptr<std::atomic<uint8_t>[]> deleted; // the tombstones, by the same indice
+        int numDeleted = 0; // kept by the writer
+    };
+    // the buffer and the trees, as seen by the queries
+    struct Snapshot{
+        vector<std::shared_ptr<Level>> levels; // slot i: a tree of at most bufferSize x 2^i points, or none
+        vector<T> buffer; // the points inserted since the latest merge, row by row
+        vector<int32_t> bufferIds;
+    };
+    // where the point of an id is: the row in the buffer (slot == inBuffer), the indice in the tree of a slot,
+    // or nowhere (slot == removed)
+    struct Location{
+        int slot;
+        int row;
+    };
+    static const int inBuffer = -1;
+    static const int removed = -2;
+    // offers the points of a tree to the heap of a query, skipping the deleted ones and giving their ids
+    struct LevelCollector{
+        KnnHeap<T> & heap;
+        const Level & level;
+        void push(T dist, int ind){ if (!level.deleted[ind].load(std::memory_order_acquire)) heap.push(dist, level.ids[ind]); }
+        T worst() const { return heap.worst(); }
+        bool reaches(T dist) const { return heap.reaches(dist); }
+        bool full() const { return heap.full(); }
+    };
+
+    std::shared_ptr<const Snapshot> snapshot() const;
+    void publish(std::shared_ptr<const Snapshot> next);
+    void merge(Snapshot & next);
+    void place(Snapshot & next, int slot, const vector<T> & values, vector<int32_t> ids);
+    void gatherLive(const Level & level, vector<T> & values, vector<int32_t> & ids) const;
+    size_t capacity(int slot) const;
+    static KnnHeap<T> & scratch();
+
+    std::shared_ptr<const Snapshot> current; // read and written atomically
+    std::mutex writer; // serializes insert(...) and remove(...)
+    vector<Location> where; // by id, kept by the writer
+    std::atomic<int> numPoints;
+    int numCol;
+    int bufferSize;
+    int leafSize;
+    int numThreads;
+};
+
+// Builds the tree of the points, whose ids are pointIds. No point is deleted.
+template <typename T>
+DynamicKdTree<T>::Level::Level(const CSVTable<T>& points, vector<int32_t> pointIds, int leafSize, int numThreads)
+    : tree(&points, T(0.1), 0, leafSize, numThreads), ids(std::move(pointIds)), deleted(new std::atomic<uint8_t>[ids.size()]){
+    for (size_t i=0; i<ids.size(); i++)
+        deleted[i].store(0, std::memory_order_relaxed);
+}
+
+// an empty index of points of dim values
+template <typename T>
+DynamicKdTree<T>::DynamicKdTree(int dim, int bufferSize, int leafSize, int numThreads)
+    : current(new Snapshot()), numPoints(0), numCol(dim), bufferSize(std::max(bufferSize, 1)),
+      leafSize(std::max(leafSize, 1)), numThreads(std::max(numThreads, 1)){
+}
+
+// an index of the rows of initial, whose ids are their indices. They make one tree.
+template <typename T>
+DynamicKdTree<T>::DynamicKdTree(const CSVTable<T>& initial, int bufferSize, int leafSize, int numThreads)
+    : DynamicKdTree(initial.dim(), bufferSize, leafSize, numThreads){
+    if (initial.size() == 0)
+        return;
+    int slot = 0;
+    while (capacity(slot) < static_cast<size_t>(initial.size()))
+        slot++;
+    std::shared_ptr<Snapshot> next(new Snapshot());
+    next->levels.resize(slot + 1);
+    vector<int32_t> ids(initial.size());
+    for (int i=0; i<initial.size(); i++)
+        ids[i] = i;
+    where.resize(initial.size());
+    std::shared_ptr<Level> level(new Level(initial, ids, leafSize, numThreads));
+    for (int i=0; i<initial.size(); i++)
+        where[i] = Location{slot, i};
+    next->levels[slot] = level;
+    numPoints = initial.size();
+    publish(next);
+}
+
+// the current snapshot
+template <typename T>
+std::shared_ptr<const typename DynamicKdTree<T>::Snapshot> DynamicKdTree<T>::snapshot() const{
+    return std::atomic_load(&current);
+}
+
+// makes next the snapshot of the queries that start from now on
+template <typename T>
+void DynamicKdTree<T>::publish(std::shared_ptr<const Snapshot> next){
+    std::atomic_store(&current, next);
+}
+
+// the largest number of points of the tree of a slot
+template <typename T>
+size_t DynamicKdTree<T>::capacity(int slot) const{
+    return static_cast<size_t>(bufferSize) << slot;
+}
+
+// Adds a point. Returns its id.
+// The point goes to the buffer; a full buffer is merged with the trees into a new tree (merge(...)).
+template <typename T>
+int DynamicKdTree<T>::insert(const RowView<T>& point){
+    if (point.size() != numCol)
+        throw std::runtime_error("The point has " + std::to_string(point.size()) + " values, the index "
+                                 + std::to_string(numCol) + ".");
+    std::lock_guard<std::mutex> lock(writer);
+    int id = static_cast<int>(where.size());
+    std::shared_ptr<Snapshot> next(new Snapshot(*snapshot()));
+    next->buffer.insert(next->buffer.end(), point.begin(), point.end());
+    next->bufferIds.push_back(id);
+    where.push_back(Location{inBuffer, static_cast<int>(next->bufferIds.size()) - 1});
+    if (static_cast<int>(next->bufferIds.size()) >= bufferSize)
+        merge(*next);
+    numPoints++;
+    publish(next);
+    return id;
+}
+
+// Deletes the point of that id. Returns false if there is none (never inserted or already deleted).
+// A point of the buffer is removed from it; a point of a tree gets a tombstone, and the tree is rebuilt
+// from its other points once half of them are deleted.
+template <typename T>
+bool DynamicKdTree<T>::remove(int id){
+    std::lock_guard<std::mutex> lock(writer);
+    if (id < 0 || id >= static_cast<int>(where.size()) || where[id].slot == removed)
+        return false;
+    Location location = where[id];
+    where[id].slot = removed;
+    numPoints--;
+
+    std::shared_ptr<const Snapshot> now = snapshot();
+    if (location.slot == inBuffer){ // the last point of the buffer takes its row
+        std::shared_ptr<Snapshot> next(new Snapshot(*now));
+        int last = static_cast<int>(next->bufferIds.size()) - 1;
+        if (location.row != last){
+            std::copy(next->buffer.begin() + static_cast<size_t>(last) * numCol, next->buffer.begin() + static_cast<size_t>(last + 1) * numCol,
+                      next->buffer.begin() + static_cast<size_t>(location.row) * numCol);
+            next->bufferIds[location.row] = next->bufferIds[last];
+            where[next->bufferIds[location.row]].row = location.row;
+        }
+        next->buffer.resize(static_cast<size_t>(last) * numCol);
+        next->bufferIds.pop_back();
+        publish(next);
+        return true;
+    }
+
+    Level & level = *now->levels[location.slot];
+    level.deleted[location.row].store(1, std::memory_order_release);
+    level.numDeleted++;
+    if (2 * static_cast<size_t>(level.numDeleted) > level.ids.size()){
+        std::shared_ptr<Snapshot> next(new Snapshot(*now));
+        vector<T> values;
+        vector<int32_t> ids;
+        gatherLive(level, values, ids);
+        place(*next, location.slot, values, std::move(ids));
+        publish(next);
+    }
+    return true;
+}
+
+// Merges the buffer and the trees of the first slots into one tree: the trees are taken in slot order up to
+// the first empty slot that can hold all their points with the buffer's, where the new tree is built.
+template <typename T>
+void DynamicKdTree<T>::merge(Snapshot & next){
+    vector<T> values;
+    vector<int32_t> ids;
+    values.swap(next.buffer);
+    ids.swap(next.bufferIds);
+    for (int slot=0; ; slot++){
+        if (slot == static_cast<int>(next.levels.size()))
+            next.levels.push_back(nullptr);
+        if (next.levels[slot]){
+            gatherLive(*next.levels[slot], values, ids);
+            next.levels[slot].reset();
+        }
+        else if (ids.size() <= capacity(slot)){
+            place(next, slot, values, std::move(ids));
+            return;
+        }
+    }
+}
+
+// Builds the tree of the points (values, row by row, whose ids are ids) in a slot, none if there are no points,
+// and records where every point is.
+template <typename T>
+void DynamicKdTree<T>::place(Snapshot & next, int slot, const vector<T> & values, vector<int32_t> ids){
+    if (ids.empty()){
+        next.levels[slot].reset();
+        return;
+    }
+    CSVTable<T> points;
+    points.assign(values.data(), static_cast<int>(ids.size()), numCol);
+    for (size_t i=0; i<ids.size(); i++)
+        where[ids[i]] = Location{slot, static_cast<int>(i)};
+    next.levels[slot].reset(new Level(points, std::move(ids), leafSize, numThreads));
+}
+
+// Appends the points of a tree that are not deleted to values (row by row) and their ids to ids.
+template <typename T>
+void DynamicKdTree<T>::gatherLive(const Level & level, vector<T> & values, vector<int32_t> & ids) const{
+    const CSVTable<T> & points = level.tree.getPoints();
+    for (int row=0; row<points.size(); row++){
+        int ind = level.tree.getId(row);
+        if (level.deleted[ind].load(std::memory_order_relaxed))
+            continue;
+        values.insert(values.end(), points.row(row).begin(), points.row(row).end());
+        ids.push_back(level.ids[ind]);
+    }
+}
+
+// The heap of the queries of the calling thread.
+template <typename T>
+KnnHeap<T> & DynamicKdTree<T>::scratch(){
+    static thread_local KnnHeap<T> heap;
+    return heap;
+}
+
+// Finds the k nearest points of the current snapshot: ind_dist = id1,dist1,id2,dist2,... nearest first.
+template <typename T>
+void DynamicKdTree<T>::knnSearch(const RowView<T>& testPoint, int k, vector<T> & ind_dist) const{
+    k = std::max(k, 0);
+    vector<int32_t> ids(k);
+    vector<T> distances(k);
+    int n = knnSearch(testPoint, k, ids.data(), distances.data());
+    ind_dist.clear();
+    for (int i=0; i<n; i++){
+        ind_dist.push_back(static_cast<T>(ids[i]));
+        ind_dist.push_back(distances[i]);
+    }
+}
+
+// Finds the k nearest points of the current snapshot, into ids[0..k-1] and distances[0..k-1], nearest first.
+// The trees are searched from the largest down, then the buffer, all with the same heap.
+// Returns the number of points found, min(k, size()).
+template <typename T>
+int DynamicKdTree<T>::knnSearch(const RowView<T>& testPoint, int k, int32_t* ids, T* distances) const{
+    std::shared_ptr<const Snapshot> now = snapshot();
+    KnnHeap<T> & found = scratch();
+    found.reset(k);
+    if (k <= 0)
+        return 0;
+    for (int slot=static_cast<int>(now->levels.size())-1; slot>=0; slot--){
+        if (!now->levels[slot])
+            continue;
+        LevelCollector collector{found, *now->levels[slot]};
+        now->levels[slot]->tree.collect(testPoint, collector);
+    }
+    for (size_t i=0; i<now->bufferIds.size(); i++)
+        found.push(distanceKernels::squared<T>(testPoint.data(), &now->buffer[i * numCol], numCol, found.worst()), now->bufferIds[i]);
+    return found.write(ids, distances);
+}
+
+// number of points
+template <typename T>
+int DynamicKdTree<T>::size() const{
+    return numPoints;
+}
+
+// number of values per point
+template <typename T>
+int DynamicKdTree<T>::dim() const{
+    return numCol;
+}
+
+// number of trees of the current snapshot
+template <typename T>
+int DynamicKdTree<T>::numTrees() const{
+    std::shared_ptr<const Snapshot> now = snapshot();
+    int n = 0;
+    for (size_t slot=0; slot<now->levels.size(); slot++)
+        n += now->levels[slot] ? 1 : 0;
+    return n;
+}
+
+#endif /* DynamicKdTree_hpp */
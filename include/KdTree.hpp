@@ -4,13 +4,42 @@
 //  KdTree class for Knn Search Algorithm.
 //
 //  KdTree is built by calling the constructor with the trainData as the input e.g. KdTree(trainData).
-//      - The default bound for the distance between the query point and the splitting hyperplane is set to 0.1.
+//      - The bound for the distance between the query point and the splitting hyperplane, used by the
+//        approximate search, is set to 0.1 by default,
 //      - or the bound can be specified explicitely via e.g KdTree(trainData, bound);
+//      - the leaves hold one point by default. With e.g. KdTree(trainData, bound, rule, 32), the leaves are buckets
+//        of up to 32 points, which are scanned in one go (scanLeaf(...)) instead of descending further.
+//      - the splitting axes of nodes larger than a sample size can be chosen from a random sample of their points,
+//        e.g. KdTree(trainData, bound, rule, 1, numThreads, 10000) (see KdTreeBuilder.hpp).
+//      - the nodes are split at the median along the axis chosen by the rule by default. Another split policy
+//        (splitPolicies.hpp) can be given instead of the rule, e.g. KdTree(trainData, bound, splitPolicy::SlidingMidpoint()).
 //
-//  When a query is given, the nearest point to the query point can be found using traverseTree(...);.
-//      - At the root, the left and right child node is traversed.
-//      - If the distance to the splitting hyperplane from the query point is smaller than the bound, the both child nodes are traversed.
-//      - If not, only one child node is traversed (by comparing to the node value).
+//  The nodes (KdNode.hpp) are kept in one contiguous array in pre-order, the node pool,
+//  and refer to their children by position. The root is the node at position 0.
+//
+//  When a query is given, the nearest point to the query point can be found using traverseTree(...);,
+//  the k nearest points using knnSearch(...); (KnnHeap.hpp),
+//  and the points within a radius using radiusSearch(...); (RadiusList.hpp), which is always exact.
+//      - The child on the query's side of the splitting hyperplane is traversed first.
+//      - The other child is traversed only if the hyperplane is close enough to the query, depending on the search mode:
+//          - exactSearch (default): closer than the k-th nearest point so far. Its points cannot be nearer otherwise,
+//            so the result is exact, and the bound tightens as closer points are found.
+//          - boundedSearch: closer than the fixed bound, and always at the root. The result is approximate:
+//            a small bound may miss neighbours, a large one visits many nodes. Set with setSearchMode(...);.
+//      - With an epsilon > 0 (setEpsilon(...);), the exact search becomes a (1+epsilon)-approximate search:
+//        a hyperplane is crossed only if it is closer than the k-th distance so far divided by 1+epsilon,
+//        so every point returned is at most 1+epsilon times farther than the true neighbour of the same rank.
+//        Unlike the bound, epsilon does not depend on the units of the data.
+//      - With a maximum number of checks (setMaxChecks(...);), the search stops going back to far children
+//        once it has compared that many points to the query and holds k of them, which caps the cost of a query.
+//        Until it holds k points, it goes on past the budget, so an exact search still gets its k points.
+//        A boundedSearch may not: the far children beyond the bound are never visited, so a query can find
+//        fewer than k points (knnSearch(...) returns how many), with or without a maximum number of checks.
+//      - At a leaf, all the points of the bucket are compared to the query point.
+//  The search works on squared distances (distanceKernels.hpp); the roots are taken only for the result.
+//  It is iterative: the far children still to visit are kept on an explicit stack, whose size is the depth of the tree.
+//  The stack and the heap are scratch buffers kept per thread and reused from one query to the next,
+//  so a query does not allocate memory (with the knnSearch(...) that writes to caller arrays).
 //
 //
 //  KdTree can be writed to CSV file and loaded from CSV file.
@@ -20,6 +49,18 @@
 //          - the indice of the datapoint in CSVTable (instead of storing the datapoint itself)
 //          - whether the node has a left child node
 //          - whether the node has a right child node
+//      - A leaf with more than one point lists the indices of its other points after these four values.
+//
+//  KdTree can also be written to and loaded from a binary model file (binaryFormat.hpp),
+//  which stores the node pool as is and is loaded by mapping the file.
+//  save(...) and load(...) pick the format: .csv for file names ending with .csv, binary otherwise.
+//
+//  KdTree keeps its own copy of the points of its nodes, in pre-order (points), so that the points visited
+//  one after the other while traversing are close in memory. The points of a node are a block of consecutive rows.
+//  If the tree has buckets, the table also gets its column-major mirror, which the bucket scan reads.
+//      - It is gathered from the trainData when the tree is built or when a model without points is loaded.
+//      - A binary model can embed it (save(fileName, true)). Such a model is self-contained:
+//        it is loaded without the trainData, and the points are used in place from the mapped file.
 //
 //
 //  Copyright © 2016 Serim Park . All rights reserved.
@@ -30,11 +71,24 @@
 #define KdTree_h
 
 #include "KdNode.hpp"
+#include "KdTreeBuilder.hpp"
 #include "statHelper.hpp"
 #include "debug.hpp"
-#include <unistd.h>
+#include "TableView.hpp"
+#include "MappedFile.hpp"
+#include "MappedArray.hpp"
+#include "binaryFormat.hpp"
+#include "KnnHeap.hpp"
+#include "RadiusList.hpp"
+#include "distanceKernels.hpp"
 #include <memory>
+#include <cstring>
+#include <stdexcept>
 #include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <sstream>
 #include <string>
 #include <fstream>
 using std::string;
@@ -45,73 +99,207 @@ using std::cout;
 template <typename T, class CSVTable>
 class KdTree{
 public:
-    
+
+    // how far the search looks across a splitting hyperplane
+    enum SearchMode{
+        exactSearch,    // when the hyperplane is closer than the k-th nearest point so far: exact
+        boundedSearch   // when the hyperplane is closer than the bound: approximate
+    };
+
     KdTree();
     KdTree(const CSVTable* trainData);
-    KdTree(const CSVTable* trainData, T up, int rule=0);
+    KdTree(const CSVTable* trainData, T up, int rule=0, int leafSize=1, int numThreads=1, int sampleSize=0);
+    template<class SplitPolicy>
+    KdTree(const CSVTable* trainData, T up, const SplitPolicy & policy, int leafSize=1, int numThreads=1, int sampleSize=0);
     ~KdTree();
-    
+
     // traverse the Tree until the nearest point is found.
-    void traverseTree(std::shared_ptr<KdNode<T, CSVTable>> p, const vector<T>& testPoint, const CSVTable* trainData, vector<T> &ind_dist) const;
-    void printTree(std::shared_ptr<KdNode<T, CSVTable>> p, const CSVTable* trainData, int indent) const; // print
-    void write2CSV(std::shared_ptr<KdNode<T, CSVTable>> p, std::ofstream &fout); // write
-    void loadCSV(std::shared_ptr<KdNode<T, CSVTable>> p, std::ifstream &fin); // read
-    
-    std::shared_ptr<KdNode<T, CSVTable>> getRoot() const; // accessor
+    void traverseTree(const RowView<T>& testPoint, vector<T> &ind_dist) const;
+    // finds the k nearest points: ind_dist = ind1,dist1,ind2,dist2,... nearest first.
+    void knnSearch(const RowView<T>& testPoint, int k, vector<T> &ind_dist) const;
+    // same, into indices[0..k-1] and distances[0..k-1]. Returns the number of points found:
+    // min(k, numPoints()), or fewer with boundedSearch.
+    int knnSearch(const RowView<T>& testPoint, int k, int32_t* indices, T* distances) const;
+    // finds the points within radius, appended to indices and distances: all of them, nearest first if sorted,
+    // or the maxCount nearest of them if maxCount > 0. Returns their number.
+    int radiusSearch(const RowView<T>& testPoint, T radius, vector<int32_t> & indices, vector<T> & distances,
+                     int maxCount = 0, bool sorted = true) const;
+    // the k-nearest search with the caller's collector, which has the interface of KnnHeap (push, worst, reaches, full).
+    template<class Collector> void collect(const RowView<T>& testPoint, Collector & found) const;
+    void printTree() const; // print
+    void write2CSV(std::ofstream &fout) const; // write
+    void loadCSV(std::ifstream &fin, const CSVTable* trainData); // read
+    void write2Binary(std::ofstream &fout, bool embedPoints = false) const; // write the binary model
+    void loadBinary(const std::string & fileName, const CSVTable* trainData = nullptr); // read the binary model
+    void save(const std::string & fileName, bool embedPoints = false) const; // write, .csv or binary depending on the file name
+    void load(const std::string & fileName, const CSVTable* trainData = nullptr); // read, .csv or binary depending on the file content
+    void attachPoints(const CSVTable* trainData); // gathers the points of the nodes from trainData
+
+    int size() const; // number of nodes
+    int numPoints() const; // number of points
+    int depth() const; // number of nodes on the longest path from the root to a leaf
+    const KdNode & getNode(int pos) const; // accessor
+    int getId(int row) const; // accessor: indice in trainData of the given row of the points
+    const CSVTable & getPoints() const; // accessor
+    statHelper::AxisExtent<T> boundingBox() const; // the bounding box of the points
     T getBound() const; // accessor
     void setBound(T up); // mutator
-    
+    SearchMode getSearchMode() const; // accessor
+    void setSearchMode(SearchMode mode); // mutator
+    T getEpsilon() const; // accessor
+    void setEpsilon(T eps); // mutator
+    int getMaxChecks() const; // accessor
+    void setMaxChecks(int checks); // mutator
+    static int64_t nodesVisited(); // number of nodes visited by the searches of the calling thread so far
+
 private:
-    T findDistance(const vector<T>& testPoint, const vector<T>& nodePoint) const;
-    T findDistanceToHyperplane(const vector<T>& testPoint, const vector<T>& nodePoint, int ax) const;
-    
-    std::shared_ptr<KdNode<T, CSVTable>> root;
-    T bound = 0.1; // bound for the distance to the hyperplane. Default to 0.1.
-    
+    template<typename, class> friend class DualTreeSearch; // compares the points of a leaf with scanLeaf(...)
+
+    // a far child still to visit, with the squared distance from the query to its splitting hyperplane
+    struct StackEntry{
+        int32_t pos;
+        T dist;
+    };
+    // per-thread buffers of the search, reused from one query to the next
+    struct Scratch{
+        KnnHeap<T> heap;
+        RadiusList<T> list;
+        vector<StackEntry> stack;
+        int64_t visited = 0; // nodes visited so far, to compare trees (e.g. split policies)
+    };
+    // how a search prunes: which far children it visits, and when it stops
+    struct Pruning{
+        bool exact;     // the far children that may hold a point found would keep, otherwise those within the bound
+        T scale;        // the squared distances to the hyperplanes are multiplied by (1+epsilon)^2
+        int maxChecks;  // points compared before the search stops going back to far children, once found is full. 0: no limit
+    };
+    static Scratch & scratch();
+    Pruning knnPruning() const;
+    template<class Collector> void search(const RowView<T>& testPoint, Collector & found, const Pruning & pruning, Scratch & buffers) const;
+    template<class Collector> void scanLeaf(const KdNode & node, const RowView<T>& testPoint, Collector & found) const;
+    void prepareSearch();
+    size_t checkNodes(const std::string & fileName) const;
+
+    MappedArray<KdNode> nodes; // the node pool, in pre-order. The root is nodes[0].
+    MappedArray<int32_t> ids; // ids[i]: indice in trainData of row i of points
+    CSVTable points; // the points of the nodes, in pre-order. The points of a node are its rows first ... first+count-1.
+    T bound = 0.1; // bound for the distance to the hyperplane in boundedSearch. Default to 0.1.
+    SearchMode searchMode = exactSearch;
+    T epsilon = 0; // the exact search is (1+epsilon)-approximate. 0: exact.
+    int maxChecks = 0; // the maximum number of points compared per query. 0: no limit.
+    int maxDepth = 0; // depth of the tree, the size of the search stack
+
 };
 
 // default constructor.
 template<typename T, class CSVTable>
 KdTree<T, CSVTable>::KdTree(){
-    root = std::shared_ptr<KdNode<T, CSVTable>>(new KdNode<T, CSVTable>());
 }
 
 // destructor
 template<typename T, class CSVTable>
 KdTree<T, CSVTable>::~KdTree(){
-    
+
 }
 
-// constructor with trainData input. Calls the Kdnode constructor for the root.
+// constructor with trainData input. Builds the node pool with KdTreeBuilder.
 template<typename T, class CSVTable>
-KdTree<T, CSVTable>::KdTree(const CSVTable* trainData): root(new KdNode<T, CSVTable>(trainData)){}
+KdTree<T, CSVTable>::KdTree(const CSVTable* trainData){
+    vector<KdNode> pool;
+    vector<int32_t> poolIds;
+    KdTreeBuilder<T, CSVTable>(trainData).build(pool, poolIds);
+    nodes.assign(std::move(pool));
+    ids.assign(std::move(poolIds));
+    attachPoints(trainData);
+}
 
 
-// constructor with trainData and Bound input. Calls the Kdnode constructor for the root.
+// constructor with trainData, Bound, rule, leaf size, thread count and sample size input.
+// The nodes are split at the median along the axis chosen by the rule (splitPolicy::Statistic).
+template<typename T, class CSVTable>
+KdTree<T, CSVTable>::KdTree(const CSVTable* trainData, T up, int rule, int leafSize, int numThreads, int sampleSize)
+    : KdTree(trainData, up, splitPolicy::Statistic(rule), leafSize, numThreads, sampleSize){
+}
+
+// constructor with trainData, Bound, split policy, leaf size, thread count and sample size input.
+// Builds the node pool with KdTreeBuilder.
 template<typename T, class CSVTable>
-KdTree<T, CSVTable>::KdTree(const CSVTable* trainData, T up, int rule): root(new KdNode<T, CSVTable>(trainData, rule)), bound(up){}
+template<class SplitPolicy>
+KdTree<T, CSVTable>::KdTree(const CSVTable* trainData, T up, const SplitPolicy & policy, int leafSize, int numThreads, int sampleSize): bound(up){
+    vector<KdNode> pool;
+    vector<int32_t> poolIds;
+    KdTreeBuilder<T, CSVTable, SplitPolicy>(trainData, policy, leafSize, numThreads, sampleSize).build(pool, poolIds);
+    nodes.assign(std::move(pool));
+    ids.assign(std::move(poolIds));
+    attachPoints(trainData);
+}
 
-//template<typename T, class CSVTable>
-//KdTree<T, CSVTable>::KdTree(const CSVTable* trainData, T up): root(new KdNode<T, CSVTable>(trainData)), bound(up){}
+// Gathers the points of the nodes from trainData into the tree's own table, in pre-order.
+template<typename T, class CSVTable>
+void KdTree<T, CSVTable>::attachPoints(const CSVTable* trainData){
+
+    for (size_t i=0; i<ids.size(); i++){
+        if (ids[i] < 0 || ids[i] >= trainData->size())
+            throw std::runtime_error("The model refers to point " + std::to_string(ids[i]) + ", but the train data has "
+                                     + std::to_string(trainData->size()) + " points.");
+    }
+    points.gather(*trainData, ids.data(), static_cast<int>(ids.size()));
+    prepareSearch();
+}
+
+// Finds the depth of the tree, which sizes the search stack.
+// If the tree has buckets of low-dimensional points, builds the column-major mirror of the points for scanLeaf(...).
+template<typename T, class CSVTable>
+void KdTree<T, CSVTable>::prepareSearch(){
+    vector<int> depths(nodes.size(), 1); // the children come after their parent in the pool
+    maxDepth = 0;
+    for (size_t i=0; i<nodes.size(); i++){
+        const KdNode & node = nodes[i];
+        if (node.hasLeft()) depths[node.leftChild(static_cast<int>(i))] = depths[i] + 1;
+        if (node.hasRight()) depths[node.rightChild()] = depths[i] + 1;
+        maxDepth = std::max(maxDepth, depths[i]);
+    }
+    if (ids.size() != nodes.size() && points.dim() < distanceKernels::checkEvery)
+        points.buildColumnMajor();
+}
+
+// Checks that every child position is inside the pool and after its parent, and that the blocks of points
+// of the nodes follow each other, so that a corrupted model cannot make a traversal loop or read out of the pool.
+// Returns the number of points of the nodes.
+template<typename T, class CSVTable>
+size_t KdTree<T, CSVTable>::checkNodes(const std::string & fileName) const{
+    int numNodes = static_cast<int>(nodes.size());
+    int64_t numPoints = 0;
+    for (int i=0; i<numNodes; i++){
+        const KdNode & node = nodes[i];
+        if ((node.hasLeft() && i+1 >= numNodes) || (node.hasRight() && (node.right <= i || node.right >= numNodes))
+            || node.first != numPoints || node.count < 1 || (node.count > 1 && !node.isLeaf()))
+            throw std::runtime_error(fileName + ": corrupted node " + std::to_string(i));
+        numPoints += node.count;
+        if (numPoints > std::numeric_limits<int32_t>::max())
+            throw std::runtime_error(fileName + ": corrupted node " + std::to_string(i));
+    }
+    return static_cast<size_t>(numPoints);
+}
 
 
 // Save the Tree to csv file
-// The tree is saved via pre-order traversing.
+// The tree is saved via pre-order traversing, i.e. in the order of the node pool.
 // For each node, four values are stored:
 //      - splitting Axis
 //      - the indice of the datapoint in CSVTable (instead of storing the datapoint itself)
 //      - whether the node has a left child node
 //      - whether the node has a right child node
+// A leaf with more than one point is followed by the indices of its other points.
 template <typename T, class CSVTable>
-void KdTree<T, CSVTable>::write2CSV(std::shared_ptr<KdNode<T, CSVTable>> p, std::ofstream &fout){
-    
-    if(p!=nullptr){
-        int medInd = p->getMedianInd();
-        int splitAxis = p->getSplitAxis();
-        fout<<medInd<<","<<splitAxis<<","<<bool(p->left)<<","<<bool(p->right)<<endl;
-        fout.flush();
-        if(p->left) write2CSV(p->left, fout);
-        if(p->right) write2CSV(p->right, fout);
+void KdTree<T, CSVTable>::write2CSV(std::ofstream &fout) const{
+
+    for (size_t i=0; i<nodes.size(); i++){
+        const KdNode & node = nodes[i];
+        fout<<ids[node.first]<<","<<node.splitAxis<<","<<node.hasLeft()<<","<<node.hasRight();
+        for (int k=1; k<node.count; k++)
+            fout<<","<<ids[node.first + k];
+        fout<<"\n";
     }
 }
 
@@ -122,162 +310,418 @@ void KdTree<T, CSVTable>::write2CSV(std::shared_ptr<KdNode<T, CSVTable>> p, std:
 //      - the indice of the datapoint in CSVTable (instead of storing the datapoint itself)
 //      - whether the node has a left child node
 //      - whether the node has a right child node
-// If the node has either left or right child node, than tree is traversed to that node.
+// followed, for a bucket, by the indices of its other points.
+// The lines are read in order into the node pool. A node without a left child is the right child
+// of the latest node whose right child has not been found yet (kept on a stack).
+// The points of the nodes are then gathered from trainData.
 template <typename T, class CSVTable>
-void KdTree<T, CSVTable>::loadCSV(std::shared_ptr<KdNode<T, CSVTable>> p, std::ifstream &fin){
-    
-    if(p!=nullptr){
-        
-        int ind, ax;
-        bool hasRight, hasLeft;
-        std::string line;
-        
-        if (getline(fin, line)){
-            
-            std::istringstream in(line);
-            std::string item1, item2, item3, item4;
-            getline(in, item1, ',');
-            getline(in, item2, ',');
-            getline(in, item3, ',');
-            getline(in, item4, ',');
-            
-            ind = atof(item1.c_str());
-            ax = atof(item2.c_str());
-            hasLeft = atof(item3.c_str());
-            hasRight = atof(item4.c_str());
-            
-            p->setMedianInd(ind);
-            p->setSplitAxis(ax);
-            
-            fin.clear();
-            usleep(500);
-            if (hasLeft && hasRight){
-                p->left = std::shared_ptr<KdNode<T, CSVTable>>(new KdNode<T, CSVTable>());
-                loadCSV(p->left, fin);
-                p->right = std::shared_ptr<KdNode<T, CSVTable>>(new KdNode<T, CSVTable>());
-                loadCSV(p->right, fin);
-            }
-            else if (hasLeft){
-                p->left = std::shared_ptr<KdNode<T, CSVTable>>(new KdNode<T, CSVTable>());
-                loadCSV(p->left, fin);
-                p->right = nullptr;
-            }
-            else if (hasRight){
-                p->right = std::shared_ptr<KdNode<T, CSVTable>>(new KdNode<T, CSVTable>());
-                loadCSV(p->right, fin);
-                p->left = nullptr;
-            }
-            else {
-                p->left = nullptr;
-                p->right = nullptr;
-            }
+void KdTree<T, CSVTable>::loadCSV(std::ifstream &fin, const CSVTable* trainData){
+
+    vector<KdNode> pool;
+    vector<int32_t> poolIds;
+    vector<int> waitingRight; // nodes whose right child is still to come
+    bool previousHasLeft = false;
+
+    for (std::string line; getline(fin, line); ){
+
+        if (line.empty() || line == "\r")
+            continue;
+
+        std::istringstream in(line);
+        std::string item1, item2, item3, item4;
+        getline(in, item1, ',');
+        getline(in, item2, ',');
+        getline(in, item3, ',');
+        getline(in, item4, ',');
+
+        int pos = static_cast<int>(pool.size());
+        KdNode node;
+        node.right = -1;
+        node.splitAxis = static_cast<int16_t>(atoi(item2.c_str()));
+        node.flags = atoi(item3.c_str()) ? KdNode::hasLeftFlag : 0;
+        node.first = static_cast<int32_t>(poolIds.size());
+        node.count = 1;
+        bool hasRight = atoi(item4.c_str()) != 0;
+        poolIds.push_back(atoi(item1.c_str()));
+        for (std::string item; getline(in, item, ','); node.count++) // the other points of a bucket
+            poolIds.push_back(atoi(item.c_str()));
+        if (node.count > 1 && (node.hasLeft() || hasRight))
+            throw std::runtime_error("Corrupted CSV model: node " + to_string(pos) + " has children and several points.");
+
+        if (pos > 0 && !previousHasLeft){ // the right child of a previous node
+            if (waitingRight.empty())
+                throw std::runtime_error("Corrupted CSV model: node " + to_string(pos) + " has no parent.");
+            pool[waitingRight.back()].right = pos;
+            waitingRight.pop_back();
         }
+        if (hasRight)
+            waitingRight.push_back(pos);
+        previousHasLeft = node.hasLeft();
+
+        pool.push_back(node);
+    }
+    if (!waitingRight.empty() || previousHasLeft)
+        throw std::runtime_error("Corrupted CSV model: missing nodes.");
+
+    nodes.assign(std::move(pool));
+    ids.assign(std::move(poolIds));
+    attachPoints(trainData);
+}
+
+// Save the Tree to a binary model file.
+// The node pool and the indices are written as they are, right after the header.
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::write2Binary(std::ofstream &fout, bool embedPoints) const{
+
+    size_t nodeBytes = nodes.size() * sizeof(KdNode);
+    size_t idBytes = ids.size() * sizeof(int32_t);
+
+    binaryFormat::ModelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, binaryFormat::modelMagic, 8);
+    header.version = binaryFormat::modelVersion;
+    header.nodeSize = sizeof(KdNode);
+    header.numNodes = nodes.size();
+    header.nodeOffset = sizeof(header);
+    header.idOffset = header.nodeOffset + nodeBytes;
+    header.checksum = binaryFormat::fnv1a(ids.data(), idBytes, binaryFormat::fnv1a(nodes.data(), nodeBytes));
+
+    uint64_t idEnd = header.idOffset + idBytes;
+    if (embedPoints){
+        header.elemType = binaryFormat::elementType<T>();
+        header.dims = static_cast<uint32_t>(points.dim());
+        header.pointOffset = binaryFormat::alignUp(idEnd, 64);
+    }
+
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char*>(nodes.data()), static_cast<std::streamsize>(nodeBytes));
+    fout.write(reinterpret_cast<const char*>(ids.data()), static_cast<std::streamsize>(idBytes));
+    if (embedPoints){
+        vector<char> padding(header.pointOffset - idEnd, 0);
+        fout.write(padding.data(), padding.size());
+        fout.write(reinterpret_cast<const char*>(points.data()), static_cast<std::streamsize>(sizeof(T) * points.size() * points.dim()));
+    }
+    fout.flush();
+}
+
+// Load the Tree from a binary model file.
+// The file is mapped and checked (magic, version, checksum, child positions).
+// The node pool and the indices are then used in place from the mapped file.
+// If the model embeds the points, they are used in place too and trainData is not needed.
+// Otherwise the points are gathered from trainData.
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::loadBinary(const std::string & fileName, const CSVTable* trainData){
+
+    std::shared_ptr<MappedFile> mapping(new MappedFile());
+    MappedFile & file = *mapping;
+    if (!file.open(fileName))
+        throw std::runtime_error("Couldn't open model file to load: " + fileName);
+
+    binaryFormat::ModelFileHeader header;
+    if (file.size() < sizeof(header) || !binaryFormat::hasMagic(file.data(), file.size(), binaryFormat::modelMagic))
+        throw std::runtime_error(fileName + ": not a binary model file");
+    memcpy(&header, file.data(), sizeof(header));
+    if (header.version != binaryFormat::modelVersion || header.nodeSize != sizeof(KdNode))
+        throw std::runtime_error(fileName + ": unsupported model version " + std::to_string(header.version));
+    if (header.numNodes > static_cast<uint64_t>(std::numeric_limits<int>::max()))
+        throw std::runtime_error(fileName + ": corrupted node count " + std::to_string(header.numNodes));
+    if (!binaryFormat::fitsInFile(file.size(), header.nodeOffset, header.numNodes, sizeof(KdNode))
+        || header.nodeOffset % alignof(KdNode) != 0)
+        throw std::runtime_error(fileName + ": truncated model file");
+    size_t nodeBytes = header.numNodes * sizeof(KdNode);
+    bool hasPoints = header.elemType != 0;
+    if (!hasPoints && trainData == nullptr)
+        throw std::runtime_error(fileName + ": the model does not embed the points, the train data is required");
+
+    nodes.attach(mapping, header.nodeOffset, header.numNodes);
+    size_t numPoints = checkNodes(fileName);
+    size_t idBytes = numPoints * sizeof(int32_t);
+    if (!binaryFormat::fitsInFile(file.size(), header.idOffset, numPoints, sizeof(int32_t)) || header.idOffset % alignof(int32_t) != 0)
+        throw std::runtime_error(fileName + ": truncated model file");
+    if (hasPoints && (header.dims == 0 || header.dims > static_cast<uint32_t>(std::numeric_limits<int>::max())
+                      || binaryFormat::elementSize(header.elemType) == 0))
+        throw std::runtime_error(fileName + ": invalid embedded points");
+    if (hasPoints && !binaryFormat::fitsInFile(file.size(), header.pointOffset, numPoints,
+                                               static_cast<uint64_t>(header.dims) * binaryFormat::elementSize(header.elemType)))
+        throw std::runtime_error(fileName + ": truncated model file");
+
+    uint64_t checksum = binaryFormat::fnv1a(file.data() + header.nodeOffset, nodeBytes);
+    checksum = binaryFormat::fnv1a(file.data() + header.idOffset, idBytes, checksum);
+    if (checksum != header.checksum)
+        throw std::runtime_error(fileName + ": checksum mismatch");
+
+    ids.attach(mapping, header.idOffset, numPoints);
+
+    if (hasPoints){
+        points.attach(mapping, header.pointOffset, static_cast<int>(numPoints), static_cast<int>(header.dims), header.elemType);
+        prepareSearch();
     }
+    else
+        attachPoints(trainData);
+}
+
+// Save the Tree. File names ending with .csv get the .csv model, any other the binary model.
+// embedPoints stores the points in the binary model too (the .csv model never has them).
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::save(const std::string & fileName, bool embedPoints) const{
+
+    bool isCSV = fileName.size() >= 4 && fileName.compare(fileName.size() - 4, 4, ".csv") == 0;
+    std::ofstream fout(fileName.c_str(), std::fstream::out | std::fstream::binary | std::fstream::trunc);
+    if (!fout.is_open())
+        throw std::runtime_error("Couldn't open model file to write: " + fileName);
+    if (isCSV)
+        write2CSV(fout);
+    else
+        write2Binary(fout, embedPoints);
+    fout.close();
+}
+
+// Load the Tree, from either a binary model file or a .csv model (detected from the first bytes).
+// trainData may be null only for a binary model that embeds the points.
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::load(const std::string & fileName, const CSVTable* trainData){
+
+    if (binaryFormat::fileHasMagic(fileName, binaryFormat::modelMagic)){
+        loadBinary(fileName, trainData);
+        return;
+    }
+    if (trainData == nullptr)
+        throw std::runtime_error(fileName + ": a .csv model does not embed the points, the train data is required");
+    std::ifstream fin(fileName.c_str(), std::fstream::in | std::fstream::binary);
+    if (!fin.is_open())
+        throw std::runtime_error("Couldn't open CSV file to load.");
+    loadCSV(fin, trainData);
+    fin.close();
 }
 
 //
-// traverseTree finds the nearest point to the query (testPoint) and the distance between the two.
+// traverseTree finds the nearest point to the query (testPoint) and the distance between the two: ind_dist = ind,dist.
 // Note that the nearest point is represented using its indice in CSVtable, than its values.
+// It is knnSearch(...) with k = 1.
 //
-// At the root node, the left and right child node is traversed.
-// At the other nodes:
-//  - If the distance to the splitting hyperplane from the query point is smaller than the bound, the both child nodes are traversed.
-//  - If not, only one child node is traversed.
+template<typename T, class CSVTable>
+void KdTree<T, CSVTable>::traverseTree(const RowView<T> & testPoint, vector<T> & ind_dist) const{
+    knnSearch(testPoint, 1, ind_dist);
+}
+
 //
-// At each node, the new distance is computed, and if it is smaller than the previously computed distance, it is updated.
+// knnSearch finds the k nearest points to the query (testPoint) and their distances.
+// The candidates are kept in a max-heap (KnnHeap), so the k-th distance so far is known at every node:
+//  - the child on the query's side of the splitting hyperplane is traversed first,
+//  - the other child only if the distance to the hyperplane is smaller than
+//      - exactSearch: the k-th distance so far (all its points are at least that far from the query),
+//      - boundedSearch: the bound, or at the root.
+// The result is ind_dist = ind1,dist1,ind2,dist2,... nearest first, with min(k, number of points) pairs.
 //
 template<typename T, class CSVTable>
-void KdTree<T, CSVTable>::traverseTree(std::shared_ptr<KdNode<T, CSVTable>> p, const vector<T> & testPoint, const CSVTable * trainData, vector<T> & ind_dist) const{
-    
-    int ax = p->getSplitAxis();
-    int ind = p->getMedianInd();
-    const vector<T> nodePoint = trainData->get(ind);
-    
-    T dist_new = findDistance(testPoint, nodePoint); // distance to the node point
-    T dist_hyperplane = findDistanceToHyperplane(testPoint, nodePoint, ax);
-    
-    DEBUG_MSG(cout, "Traversing down:" + to_string_with_precision(ind, 3)+ ": "+returnStringVector(nodePoint));
-    bool isRoot = ind_dist.empty();
-    
-    if (isRoot){ // at root go to both direction & update the ind_dist at the root
-        ind_dist.push_back(ind);
-        ind_dist.push_back(dist_new);
-        
-        if(p->left)
-            traverseTree(p->left, testPoint, trainData, ind_dist);
-        if(p->right)
-            traverseTree(p->right, testPoint, trainData, ind_dist);
+void KdTree<T, CSVTable>::knnSearch(const RowView<T> & testPoint, int k, vector<T> & ind_dist) const{
+    Scratch & buffers = scratch();
+    buffers.heap.reset(k);
+    search(testPoint, buffers.heap, knnPruning(), buffers);
+    buffers.heap.write(ind_dist);
+}
+
+// knnSearch(...) into indices[0..k-1] and distances[0..k-1], nearest first.
+// Returns the number of points found, min(k, numPoints()). Does not allocate memory once the scratch buffers
+// of the thread are large enough for k and for the depth of the tree.
+template<typename T, class CSVTable>
+int KdTree<T, CSVTable>::knnSearch(const RowView<T> & testPoint, int k, int32_t* indices, T* distances) const{
+    Scratch & buffers = scratch();
+    buffers.heap.reset(k);
+    search(testPoint, buffers.heap, knnPruning(), buffers);
+    return buffers.heap.write(indices, distances);
+}
+
+//
+// radiusSearch finds the points within radius of the query (testPoint), distance <= radius.
+// The search is the exact k-nearest search with a fixed bound: a subtree is visited only if its splitting hyperplane
+// is within radius, whatever the search mode, epsilon and maximum number of checks.
+//  - maxCount <= 0: all the points, collected in a RadiusList, nearest first if sorted (otherwise in visiting order).
+//  - maxCount > 0: the maxCount nearest of them, collected in a KnnHeap limited to the radius (which also tightens
+//    the pruning once maxCount points are found), nearest first.
+// The indices and distances are appended to indices and distances. Returns the number of points found.
+//
+template<typename T, class CSVTable>
+int KdTree<T, CSVTable>::radiusSearch(const RowView<T> & testPoint, T radius, vector<int32_t> & indices, vector<T> & distances,
+                                      int maxCount, bool sorted) const{
+    Scratch & buffers = scratch();
+    size_t before = indices.size();
+    if (radius < 0)
+        return 0;
+    if (maxCount > 0){
+        buffers.heap.reset(maxCount, radius * radius);
+        search(testPoint, buffers.heap, Pruning{true, 1, 0}, buffers);
+        int n = buffers.heap.size();
+        indices.resize(before + n);
+        distances.resize(before + n);
+        buffers.heap.write(indices.data() + before, distances.data() + before);
     }
     else{
-        if (dist_new < ind_dist[1]){
-            ind_dist[0] = ind;
-            ind_dist[1] = dist_new;
-            DEBUG_MSG(cout, " Distanced updated:" + to_string_with_precision(ind_dist[1],2)+" to " + to_string_with_precision(dist_new,2));
-        }
-        if(dist_hyperplane < bound){ // if the distance to the hyperplane is too small
-            if(p->left)
-                traverseTree(p->left, testPoint, trainData, ind_dist);
-            if(p->right)
-                traverseTree(p->right, testPoint, trainData, ind_dist);
-        }
-        
-        else if (nodePoint[ax] < testPoint[ax]){
-            if(p->right)
-                traverseTree(p->right, testPoint, trainData, ind_dist);
-        }
-        else if (nodePoint[ax] > testPoint[ax]){
-            if(p->left)
-                traverseTree(p->left, testPoint, trainData, ind_dist);
-        }
-        else
-            ; // do nothing
+        buffers.list.reset(radius * radius);
+        search(testPoint, buffers.list, Pruning{true, 1, 0}, buffers);
+        buffers.list.write(indices, distances, sorted);
     }
+    return static_cast<int>(indices.size() - before);
 }
 
-// Finds the distance between the query point (testPoint) and the splitting hyperplane.
+// Searches the tree as knnSearch(...) does, but offers the points to found, which has the interface of KnnHeap:
+// push(squared distance, indice), worst(), reaches(squared distance) and full(). found may e.g. skip some points
+// or gather the candidates of several trees (DynamicKdTree.hpp).
 template<typename T, class CSVTable>
-T KdTree<T, CSVTable>::findDistanceToHyperplane(const vector<T>& testPoint, const vector<T>& nodePoint, int ax) const{
-    return std::abs(testPoint[ax] - nodePoint[ax]);
+template<class Collector>
+void KdTree<T, CSVTable>::collect(const RowView<T> & testPoint, Collector & found) const{
+    search(testPoint, found, knnPruning(), scratch());
 }
 
-// Finds the distance between the query point (testPoint) and the node point. 
+// The scratch buffers of the calling thread.
 template<typename T, class CSVTable>
-T KdTree<T, CSVTable>::findDistance(const vector<T>& testPoint, const vector<T>& nodePoint) const{
-    T dist = 0;
-    for (int i=0; i<testPoint.size(); i++){
-        dist += pow(testPoint[i] - nodePoint[i],2);
+typename KdTree<T, CSVTable>::Scratch & KdTree<T, CSVTable>::scratch(){
+    static thread_local Scratch buffers;
+    return buffers;
+}
+
+// Number of nodes visited by the searches of the calling thread so far.
+// The average over a set of queries measures how well the tree suits them, e.g. to compare split policies.
+template<typename T, class CSVTable>
+int64_t KdTree<T, CSVTable>::nodesVisited(){
+    return scratch().visited;
+}
+
+// The pruning of the k-nearest searches: the search mode, epsilon and the maximum number of checks.
+template<typename T, class CSVTable>
+typename KdTree<T, CSVTable>::Pruning KdTree<T, CSVTable>::knnPruning() const{
+    Pruning pruning;
+    pruning.exact = searchMode == exactSearch;
+    pruning.scale = (1 + epsilon) * (1 + epsilon);
+    pruning.maxChecks = maxChecks;
+    return pruning;
+}
+
+// Searches the tree, offering the points to found: a KnnHeap (knnSearch(...)) or a RadiusList (radiusSearch(...)).
+// The search goes down to the near child of every node. The far child is pushed on the stack with the distance
+// to the splitting hyperplane, and is visited, once the near subtree is done, only if it can still hold a point
+// found would keep, the distance scaled by (1+epsilon)^2 (exact), or if it is within the bound (not exact, see boundedSearch).
+// Once pruning.maxChecks points are compared and found holds all the points it wants (a KnnHeap with k points),
+// the far children left on the stack are dropped.
+// At most one far child per level waits on the stack, so it never holds more than the depth of the tree.
+template<typename T, class CSVTable>
+template<class Collector>
+void KdTree<T, CSVTable>::search(const RowView<T> & testPoint, Collector & found, const Pruning & pruning, Scratch & buffers) const{
+
+    if (nodes.empty() || !found.reaches(0))
+        return;
+    if (buffers.stack.size() < static_cast<size_t>(maxDepth))
+        buffers.stack.resize(maxDepth);
+    StackEntry* stack = buffers.stack.data();
+    int top = 0;
+    int dims = points.dim();
+    int pos = 0;
+    int checks = 0;
+
+    while (true){
+        const KdNode & node = nodes[pos];
+        buffers.visited++;
+        checks += node.count;
+        int next = -1;
+        if (node.count > 1) // a bucket
+            scanLeaf(node, testPoint, found);
+        else{
+            const T* nodePoint = points.row(node.first).data();
+            found.push(distanceKernels::squaredDim<CSVTable::fixedDim>(testPoint.data(), nodePoint, dims, found.worst()), ids[node.first]);
+
+            int ax = node.splitAxis;
+            if (ax >= 0){
+                // the left child holds the points up to the node value along ax, the right child the points above it
+                T diff = testPoint[ax] - nodePoint[ax];
+                int left = node.hasLeft() ? node.leftChild(pos) : -1;
+                next = diff <= 0 ? left : node.rightChild();
+                int farChild = diff <= 0 ? node.rightChild() : left;
+                if (farChild >= 0 && (pruning.exact || pos == 0 || std::abs(diff) < bound)){
+                    stack[top].pos = farChild;
+                    stack[top].dist = diff * diff;
+                    top++;
+                }
+            }
+        }
+        if (next >= 0){
+            pos = next;
+            continue;
+        }
+        // back to the latest far child that can still hold a nearer point
+        while (top > 0 && pruning.exact && !found.reaches(stack[top-1].dist * pruning.scale))
+            top--;
+        if (top == 0 || (pruning.maxChecks > 0 && checks >= pruning.maxChecks && found.full()))
+            break;
+        pos = stack[--top].pos;
     }
-    dist = sqrt(dist);
-    return dist;
 }
 
+// Compares all the points of a bucket to the query point and offers them to found.
+// Low-dimensional points are read from the column-major mirror, where the values of a bucket along one axis
+// are contiguous, so that the squared distances of up to blockSize points are accumulated axis by axis
+// in a loop the compiler vectorizes.
+// High-dimensional points are compared one at a time with the distance kernel, which gives up on a point
+// as soon as it is farther than the k-th nearest so far.
+template<typename T, class CSVTable>
+template<class Collector>
+void KdTree<T, CSVTable>::scanLeaf(const KdNode & node, const RowView<T> & testPoint, Collector & found) const{
+
+    if (!points.hasColumnMajor()){
+        for (int row = node.first; row < node.first + node.count; row++)
+            found.push(distanceKernels::squaredDim<CSVTable::fixedDim>(testPoint.data(), points.row(row).data(), points.dim(), found.worst()), ids[row]);
+        return;
+    }
 
-// print the tree to the console
+    const int blockSize = 64;
+    T dist[blockSize];
+    int dims = points.dim();
+    for (int begin = node.first; begin < node.first + node.count; begin += blockSize){
+        int len = std::min(blockSize, node.first + node.count - begin);
+        for (int k=0; k<len; k++)
+            dist[k] = 0;
+        for (int j=0; j<dims; j++){
+            const T* values = points.col(j).data() + begin;
+            T q = testPoint[j];
+            for (int k=0; k<len; k++){
+                T diff = values[k] - q;
+                dist[k] += diff * diff;
+            }
+        }
+        for (int k=0; k<len; k++)
+            found.push(dist[k], ids[begin + k]);
+    }
+}
+
+// print the tree to the console.
+// The nodes are printed in pre-order, i.e. in the order of the node pool, indented by their depth.
 template<typename T, class CSVTable>
-void KdTree<T, CSVTable>::printTree(std::shared_ptr<KdNode<T, CSVTable>> p, const CSVTable* trainData, int indent)const {
-    
-    if(p!=nullptr){
+void KdTree<T, CSVTable>::printTree()const {
+
+    vector<int> indents(nodes.size(), 0);
+    for (size_t i=0; i<nodes.size(); i++){
+        const KdNode & node = nodes[i];
+        int indent = indents[i];
         if(indent){
             std::cout<<std::setw(indent)<<' ';
         }
-        int medInd = p->getMedianInd();
-        auto element = trainData->get(medInd);
-        
-        std::cout<<medInd<<":";
-        printVector<T>(element);
-        std::cout<<" ax:"<<p->getSplitAxis();
+        for (int row = node.first; row < node.first + node.count; row++){ // the points of a bucket on one line
+            vector<T> element = points.get(row);
+            std::cout<<ids[row]<<":";
+            printVector<T>(element);
+            std::cout<<" ";
+        }
+        std::cout<<"ax:"<<node.splitAxis;
         std::cout<<std::endl;
-        
-        if(p->left) printTree(p->left, trainData, indent+4);
-        if(p->right) printTree(p->right, trainData, indent+4);
-        
+
+        if(node.hasLeft()) indents[node.leftChild(static_cast<int>(i))] = indent+4;
+        if(node.hasRight()) indents[node.rightChild()] = indent+4;
     }
 }
 
 // mutator
 template <typename T, class CSVTable>
 void KdTree<T, CSVTable>::setBound(T up){
-    return bound = up;
+    bound = up;
 }
 
 // accessor
@@ -286,10 +730,85 @@ T KdTree<T, CSVTable>::getBound() const{
     return bound;
 }
 
+// mutator
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::setSearchMode(SearchMode mode){
+    searchMode = mode;
+}
+
+// accessor
+template <typename T, class CSVTable>
+typename KdTree<T, CSVTable>::SearchMode KdTree<T, CSVTable>::getSearchMode() const{
+    return searchMode;
+}
+
+// mutator. 0 makes the search exact again.
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::setEpsilon(T eps){
+    epsilon = std::max(eps, T(0));
+}
+
+// accessor
+template <typename T, class CSVTable>
+T KdTree<T, CSVTable>::getEpsilon() const{
+    return epsilon;
+}
+
+// mutator. 0 removes the limit.
+template <typename T, class CSVTable>
+void KdTree<T, CSVTable>::setMaxChecks(int checks){
+    maxChecks = std::max(checks, 0);
+}
+
+// accessor
+template <typename T, class CSVTable>
+int KdTree<T, CSVTable>::getMaxChecks() const{
+    return maxChecks;
+}
+
+// the bounding box of the points
+template <typename T, class CSVTable>
+statHelper::AxisExtent<T> KdTree<T, CSVTable>::boundingBox() const{
+    statHelper::AxisExtent<T> box(points.dim());
+    for (int row=0; row<points.size(); row++)
+        box.add(points.row(row).data());
+    return box;
+}
+
+// number of nodes
+template <typename T, class CSVTable>
+int KdTree<T, CSVTable>::size() const{
+    return static_cast<int>(nodes.size());
+}
+
+// number of points
+template <typename T, class CSVTable>
+int KdTree<T, CSVTable>::numPoints() const{
+    return static_cast<int>(ids.size());
+}
+
+// number of nodes on the longest path from the root to a leaf
+template <typename T, class CSVTable>
+int KdTree<T, CSVTable>::depth() const{
+    return maxDepth;
+}
+
+// accessor
+template <typename T, class CSVTable>
+const KdNode & KdTree<T, CSVTable>::getNode(int pos) const{
+    return nodes[pos];
+}
+
+// accessor
+template <typename T, class CSVTable>
+int KdTree<T, CSVTable>::getId(int row) const{
+    return ids[row];
+}
+
 // accessor
 template <typename T, class CSVTable>
-std::shared_ptr<KdNode<T, CSVTable>> KdTree<T, CSVTable>::getRoot() const{
-    return root;
+const CSVTable & KdTree<T, CSVTable>::getPoints() const{
+    return points;
 }
 
 
@@ -0,0 +1,360 @@
+//
+//  KdTreeBuilder.hpp
+//
+//  KdTreeBuilder builds the node pool of a KdTree (see KdNode.hpp) from the trainData.
+//
+//  Given a set of points, a node is created and the points are split into left and right child nodes.
+//  The point the node is split at (by default the median point) is stored as the node's point.
+//  Rather than storing the point, the indice for that point (in the corresponding CSVTable) is kept.
+//
+//  The recursion stops when at most leafSize points are left: they all go to a leaf (a bucket).
+//  The default leaf size of 1 gives one point per node.
+//
+//  The nodes are appended to the pool in pre-order, so that the left child of a node is the next node.
+//  For every node, the indices of its points in CSVTable are appended to ids.
+//
+//  The build works in place on a single permutation of the indices of the points (perm):
+//  a node owns a range of perm, which is rearranged around the node's point (for the median, with nth_element) as
+//      [left child's points | node's point | right child's points],
+//  and the children are built on the two subranges. No indices are copied per node,
+//  so the build takes O(n log n) time and O(n) memory in total.
+//
+//  With several threads (numThreads), the tree is built in parallel:
+//      - The top levels are built first. At the task depth, where there are a few subtrees per thread,
+//        the subtrees are not built but deferred: a placeholder node stands for each of them.
+//      - The deferred subtrees own disjoint ranges of perm, so they are built as parallel tasks (parallel.hpp),
+//        each into its own node pool, then spliced into the pool in place of their placeholders.
+//      - In the top levels, where a node holds most of the points, the statistics of the axes are computed
+//        in parallel (one task per chunk of points).
+//  The tree does not depend on the number of threads.
+//
+//  KdTreeBuilder splits the points into left and right child nodes via:
+//          - partitionRange(...);
+//  KdTreeBuilder finds the splitting axis and point with the split policy (splitPolicies.hpp), by default
+//  the median along the axis chosen according to 3 criteria (splitPolicy::Statistic):
+//          - maximizing variance
+//          - mininmizing skew
+//          - minimizing kurtosis
+//  The policies gather the statistics of all the axes in one pass over the points of the node (accumulate(...)).
+//  The statistics are accumulated by chunks of statChunk points, merged in order, whatever the number of threads.
+//  With a sample size (sampleSize > 0), the statistics of a node with more points are estimated
+//  from sampleSize of its points, drawn at random (with a seed given by the node's range, so the tree is reproducible).
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef KdTreeBuilder_h
+#define KdTreeBuilder_h
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include "KdNode.hpp"
+#include "statHelper.hpp"
+#include "splitPolicies.hpp"
+#include "debug.hpp"
+#include "parallel.hpp"
+using std::vector;
+using std::cout;
+using std::endl;
+using std::to_string;
+
+
+template <typename T, class CSVTable, class SplitPolicy = splitPolicy::Statistic>
+class KdTreeBuilder{
+
+public:
+
+    KdTreeBuilder(const CSVTable* trainData, const SplitPolicy & policy = SplitPolicy(), int leafSize=1, int numThreads=1, int sampleSize=0); // constructor
+    ~KdTreeBuilder(); // default destructor
+
+    void build(vector<KdNode> & nodes, vector<int32_t> & ids); // builds the whole tree
+
+    // for the split policies: gathers the statistics of the points perm[begin, end) (or of their sample) into an accumulator
+    template<class Accumulator> void accumulate(int begin, int end, bool inParallel, Accumulator & into) const;
+
+private:
+
+    // a subtree deferred to a parallel task: its range of perm, and the node pool it is built into
+    struct Subtree{
+        int begin;
+        int end;
+        int depth;
+        vector<KdNode> nodes;
+        vector<int32_t> ids;
+    };
+
+    int buildNode(int begin, int end, int depth, vector<KdNode> & nodes, vector<int32_t> & ids, bool topLevel);
+    int partitionRange(const splitPolicy::Split<T> & split, int begin, int end);
+    static int samplePos(uint64_t seed, int i, int n);
+    void splice(vector<KdNode> & nodes, vector<int32_t> & ids);
+    static bool isDeferred(const KdNode & node){ return node.count == 0; }
+
+    const CSVTable* trainData;
+    SplitPolicy policy; // where the nodes are split
+    int leafSize; // the maximum number of points of a leaf
+    int numThreads; // threads of the build
+    int sampleSize; // points of the sample the statistics of a larger node are estimated from (0: all the points)
+    int taskDepth; // depth of the subtrees deferred to parallel tasks
+    vector<int> perm; // the indices of the points; every node owns a range of it
+    vector<Subtree> subtrees; // the deferred subtrees
+
+    static const int parallelMinPoints = 1 << 16; // nodes with fewer points compute their split on one thread
+    static const int statChunk = 1 << 12; // points per chunk of the statistics
+};
+
+// constructor
+template<typename T, class CSVTable, class SplitPolicy>
+KdTreeBuilder<T, CSVTable, SplitPolicy>::KdTreeBuilder(const CSVTable* trainData, const SplitPolicy & policy, int leafSize, int numThreads, int sampleSize)
+    : trainData(trainData), policy(policy), leafSize(leafSize), numThreads(std::max(numThreads, 1)), sampleSize(std::max(sampleSize, 0)){
+    // about 4 subtrees per thread, so that uneven subtrees are balanced
+    taskDepth = 1;
+    while (this->numThreads > 1 && (1 << (taskDepth - 1)) < 4 * this->numThreads)
+        taskDepth++;
+    if (leafSize < 1)
+        throw std::runtime_error("The leaf size must be at least 1.");
+    if (trainData->dim() > std::numeric_limits<int16_t>::max())
+        throw std::runtime_error("KdTree supports at most " + to_string(std::numeric_limits<int16_t>::max()) + " dimensions.");
+}
+
+// default destructor
+template<typename T, class CSVTable, class SplitPolicy>
+KdTreeBuilder<T, CSVTable, SplitPolicy>::~KdTreeBuilder(){
+}
+
+// Builds the tree for the entire trainData.
+// At the root, the node owns the whole permutation of the indices.
+// With several threads, the deferred subtrees are then built in parallel and spliced into the pool.
+template<typename T, class CSVTable, class SplitPolicy>
+void KdTreeBuilder<T, CSVTable, SplitPolicy>::build(vector<KdNode> & nodes, vector<int32_t> & ids){
+
+    nodes.clear();
+    ids.clear();
+    nodes.reserve(trainData->size());
+    ids.reserve(trainData->size());
+
+    perm.resize(trainData->size());
+    for(int i=0; i<trainData->size(); i++){
+        perm[i] = i;
+    }
+    if (!perm.empty())
+        buildNode(0, static_cast<int>(perm.size()), 1, nodes, ids, true); // root node has depth 1
+
+    if (!subtrees.empty()){
+        parallel::forEach(static_cast<int>(subtrees.size()), numThreads, [&](int task){
+            Subtree & subtree = subtrees[task];
+            subtree.nodes.reserve(subtree.end - subtree.begin);
+            subtree.ids.reserve(subtree.end - subtree.begin);
+            buildNode(subtree.begin, subtree.end, subtree.depth, subtree.nodes, subtree.ids, false);
+        });
+        splice(nodes, ids);
+    }
+    vector<int>().swap(perm);
+}
+
+// Replaces the placeholder of every deferred subtree by the subtree's nodes, keeping the pool in pre-order.
+// The positions of the right children and the blocks of points are shifted to the final positions.
+template<typename T, class CSVTable, class SplitPolicy>
+void KdTreeBuilder<T, CSVTable, SplitPolicy>::splice(vector<KdNode> & nodes, vector<int32_t> & ids){
+
+    vector<int32_t> newPos(nodes.size()); // final position of each node of the top levels
+    size_t total = 0;
+    for (size_t i=0; i<nodes.size(); i++){
+        newPos[i] = static_cast<int32_t>(total);
+        total += isDeferred(nodes[i]) ? subtrees[nodes[i].first].nodes.size() : 1;
+    }
+
+    vector<KdNode> pool;
+    vector<int32_t> poolIds;
+    pool.reserve(total);
+    poolIds.reserve(trainData->size());
+    for (size_t i=0; i<nodes.size(); i++){
+        const KdNode & node = nodes[i];
+        if (isDeferred(node)){
+            Subtree & subtree = subtrees[node.first];
+            int32_t nodeBase = static_cast<int32_t>(pool.size());
+            int32_t idBase = static_cast<int32_t>(poolIds.size());
+            for (size_t j=0; j<subtree.nodes.size(); j++){
+                KdNode shifted = subtree.nodes[j];
+                shifted.first += idBase;
+                if (shifted.hasRight())
+                    shifted.right += nodeBase;
+                pool.push_back(shifted);
+            }
+            poolIds.insert(poolIds.end(), subtree.ids.begin(), subtree.ids.end());
+            vector<KdNode>().swap(subtree.nodes);
+            vector<int32_t>().swap(subtree.ids);
+        }
+        else{
+            KdNode shifted = node;
+            shifted.first = static_cast<int32_t>(poolIds.size());
+            if (shifted.hasRight())
+                shifted.right = newPos[node.right];
+            pool.push_back(shifted);
+            poolIds.insert(poolIds.end(), ids.begin() + node.first, ids.begin() + node.first + node.count);
+        }
+    }
+    nodes.swap(pool);
+    ids.swap(poolIds);
+    subtrees.clear();
+}
+
+// Creates the node for the points trainData[perm[begin, end)], then the nodes of its children. Returns the node's position.
+// In the top levels of a parallel build (topLevel), a subtree at the task depth is deferred instead:
+// a placeholder node (count 0, first = the subtree's number) is added, and the subtree is built later.
+// If there are at most leafSize points, the node is a leaf holding all of them (in increasing order of indice).
+// Otherwise, the split policy finds the splitting axis and the splitting value (by default the median value).
+// The range is rearranged around the splitting value.
+// The data that yields the splitting value will be the representative of this node.
+// The points before it go to the left child node, the points after it to the right child node.
+template<typename T, class CSVTable, class SplitPolicy>
+int KdTreeBuilder<T, CSVTable, SplitPolicy>::buildNode(int begin, int end, int depth, vector<KdNode> & nodes, vector<int32_t> & ids, bool topLevel){
+
+    int pos = static_cast<int>(nodes.size());
+    int numPoints = end - begin;
+    KdNode node;
+    node.right = -1;
+    node.splitAxis = -1;
+    node.flags = 0;
+    node.first = static_cast<int32_t>(ids.size());
+    node.count = 1;
+
+    if (topLevel && numThreads > 1 && depth == taskDepth && numPoints > leafSize){
+        Subtree subtree;
+        subtree.begin = begin;
+        subtree.end = end;
+        subtree.depth = depth;
+        node.first = static_cast<int32_t>(subtrees.size());
+        node.count = 0;
+        nodes.push_back(node);
+        subtrees.push_back(std::move(subtree));
+        return pos;
+    }
+
+    if (numPoints <= leafSize){ // the leaf
+        node.count = numPoints;
+        nodes.push_back(node);
+        std::sort(perm.begin() + begin, perm.begin() + end);
+        ids.insert(ids.end(), perm.begin() + begin, perm.begin() + end);
+        return pos;
+    }
+
+    bool inParallel = topLevel && numThreads > 1 && numPoints >= parallelMinPoints;
+    splitPolicy::Split<T> split = policy.template choose<T>(*this, begin, end, inParallel); //find the splitting axis.
+    DEBUG_MSG(cout, "Depth " + to_string(depth) + " Indices:" + returnStringVector(vector<int>(perm.begin() + begin, perm.begin() + end),0));
+    int medianPos = partitionRange(split, begin, end); // perm[medianPos] yields the splitting value
+    node.splitAxis = static_cast<int16_t>(split.axis);
+    nodes.push_back(node);
+    ids.push_back(perm[medianPos]);
+    DEBUG_MSG(cout,"Node Indice:" + to_string(perm[medianPos]));
+    DEBUG_MSG(cout, "---------------------");
+
+    if (medianPos > begin){
+        nodes[pos].flags |= KdNode::hasLeftFlag;
+        buildNode(begin, medianPos, depth+1, nodes, ids, topLevel); // lands at pos+1
+    }
+    if (medianPos + 1 < end){
+        nodes[pos].right = static_cast<int32_t>(nodes.size());
+        buildNode(medianPos + 1, end, depth+1, nodes, ids, topLevel);
+    }
+    return pos;
+}
+
+// partitionRange(...) splits the points perm[begin, end) into the left and right child nodes
+// by comparing them to the splitting value of the node, in place.
+//
+// At the median (split.atMedian), the splitting value is the (n/2)-th smallest value along the axis, found by nth_element.
+// Otherwise, it is the largest value not greater than split.value. If there is none (e.g. the value is below
+// a sampled bounding box), the median is used.
+// The node is represented by the point of smallest indice that has the splitting value.
+// The range is rearranged as [left child | node | right child]:
+//      e.g. if (trainData[perm[i]] <= splitting value) and perm[i] is not the node,
+//              trainData[perm[i]] belongs to the left node.
+//           if (trainData[perm[i]] > splitting value)
+//              trainData[perm[i]] belongs to the right node.
+// Returns the position of the node in perm.
+template<typename T, class CSVTable, class SplitPolicy>
+int KdTreeBuilder<T, CSVTable, SplitPolicy>::partitionRange(const splitPolicy::Split<T> & split, int begin, int end){
+
+    auto col = trainData->col(split.axis);
+    int* first = perm.data() + begin;
+    int* last = perm.data() + end;
+    int* greater = first; // the points after it are greater than the splitting value
+    T value = 0;
+    if (!split.atMedian){
+        greater = std::partition(first, last, [&](int i){ return !(split.value < col[i]); });
+        if (greater != first)
+            value = col[*std::max_element(first, greater, [&](int a, int b){ return col[a] < col[b]; })];
+    }
+    if (greater == first){
+        int* middle = first + (end - begin) / 2;
+        std::nth_element(first, middle, last, [&](int a, int b){ return col[a] < col[b]; });
+        value = col[*middle];
+        // points equal to the median may lie on both sides of it: bring those after it before the greater ones
+        greater = std::partition(middle + 1, last, [&](int i){ return !(value < col[i]); });
+    }
+
+    int* node = nullptr;
+    for (int* p = first; p != greater; p++){
+        if (col[*p] == value && (node == nullptr || *p < *node))
+            node = p;
+    }
+    std::iter_swap(node, greater - 1);
+    return static_cast<int>(greater - 1 - perm.data());
+}
+
+
+// accumulate(...) gathers the statistics of the points perm[begin, end) into the accumulator into
+// (reset(dim), add(point), merge(other): see statHelper.hpp), reading every point once.
+// With a sample size, a node with more points is represented by sampleSize of them, drawn at random.
+// Large sets are accumulated by chunks of statChunk points, merged in order, so that the result
+// does not depend on the threads. inParallel: the chunks are accumulated on several threads.
+template<typename T, class CSVTable, class SplitPolicy>
+template<class Accumulator>
+void KdTreeBuilder<T, CSVTable, SplitPolicy>::accumulate(int begin, int end, bool inParallel, Accumulator & into) const{
+
+    int n = end - begin;
+    bool sampled = sampleSize > 0 && n > sampleSize;
+    int numSamples = sampled ? sampleSize : n;
+    uint64_t seed = (static_cast<uint64_t>(begin) << 32) | static_cast<uint32_t>(end);
+    int dim = trainData->dim();
+
+    auto accumulateRange = [&](Accumulator & chunkInto, int from, int to){
+        chunkInto.reset(dim);
+        for (int i=from; i<to; i++){
+            int pos = sampled ? samplePos(seed, i, n) : i;
+            chunkInto.add(trainData->row(perm[begin + pos]).data());
+        }
+    };
+
+    int numChunks = (numSamples + statChunk - 1) / statChunk;
+    if (numChunks <= 1){
+        accumulateRange(into, 0, numSamples);
+        return;
+    }
+    vector<Accumulator> chunks(numChunks);
+    parallel::forEach(numChunks, inParallel ? numThreads : 1, [&](int chunk){
+        accumulateRange(chunks[chunk], chunk * statChunk, std::min(numSamples, (chunk + 1) * statChunk));
+    });
+    into.reset(dim);
+    for (int chunk=0; chunk<numChunks; chunk++)
+        into.merge(chunks[chunk]);
+}
+
+// The position in [0, n) of the i-th point of the sample of a node, drawn from the seed of the node (splitmix64).
+template<typename T, class CSVTable, class SplitPolicy>
+int KdTreeBuilder<T, CSVTable, SplitPolicy>::samplePos(uint64_t seed, int i, int n){
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL * (static_cast<uint64_t>(i) + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return static_cast<int>(z % static_cast<uint64_t>(n));
+}
+
+#endif /* KdTreeBuilder_h */
@@ -0,0 +1,118 @@
+//
+//  KnnHeap.hpp
+//
+//  KnnHeap keeps the k nearest points found so far during a k-nearest-neighbour search.
+//
+//  The candidates are kept in a max-heap on the distance, so that
+//      - the k-th distance (the farthest of the k best, worst()) is read in constant time,
+//        and the search can prune every subtree that cannot get closer than it,
+//      - a closer point replaces the farthest candidate in O(log k).
+//  Equal distances are ordered by indice, so that the result does not depend on the visiting order.
+//  The distances are squared distances; write(...) takes their roots.
+//  A limit on the distance can be set (reset(k, limit)): farther candidates are rejected, so the heap keeps
+//  the k nearest points within the limit (the radius search with a maximum count).
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef KnnHeap_hpp
+#define KnnHeap_hpp
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+
+template <typename T>
+class KnnHeap{
+
+public:
+
+    KnnHeap(int k = 1): k(k){ heap.reserve(k); }
+
+    void reset(int newK, T newLimit = std::numeric_limits<T>::infinity()); // empties the heap, sets k and the limit
+    void push(T dist, int ind); // offers a candidate (squared distance), kept if it is among the k nearest so far
+    bool full() const { return static_cast<int>(heap.size()) >= k; }
+    T worst() const; // the k-th squared distance so far, the limit (infinity by default) until k candidates are found
+    bool reaches(T dist) const; // whether a point at that squared distance could still be kept
+    int size() const { return static_cast<int>(heap.size()); }
+    void write(std::vector<T> & ind_dist); // writes ind1,dist1,ind2,dist2,... nearest first. Empties the heap.
+    int write(int32_t* indices, T* distances); // writes the indices and distances, nearest first. Returns their number. Empties the heap.
+
+private:
+    std::vector<std::pair<T, int>> heap; // (distance, indice), the farthest first
+    int k;
+    T limit = std::numeric_limits<T>::infinity(); // candidates farther than it are rejected
+};
+
+// empties the heap, sets k and the limit
+template <typename T>
+void KnnHeap<T>::reset(int newK, T newLimit){
+    heap.clear();
+    k = newK;
+    limit = newLimit;
+    if (k > 0)
+        heap.reserve(k);
+}
+
+// offers a candidate, kept if it is among the k nearest so far
+template <typename T>
+void KnnHeap<T>::push(T dist, int ind){
+    std::pair<T, int> candidate(dist, ind);
+    if (dist > limit)
+        return;
+    if (!full()){
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end());
+    }
+    else if (candidate < heap.front()){
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+// the k-th squared distance so far, the limit until k candidates are found
+template <typename T>
+T KnnHeap<T>::worst() const{
+    return full() ? std::min(heap.front().first, limit) : limit;
+}
+
+// whether a point at that squared distance could still be kept:
+// nearer than the k-th so far, and not farther than the limit
+template <typename T>
+bool KnnHeap<T>::reaches(T dist) const{
+    if (!full())
+        return dist <= limit;
+    return !heap.empty() && dist < heap.front().first && dist <= limit; // k <= 0 keeps nothing
+}
+
+// writes ind1,dist1,ind2,dist2,... nearest first. Empties the heap.
+template <typename T>
+void KnnHeap<T>::write(std::vector<T> & ind_dist){
+    std::sort_heap(heap.begin(), heap.end());
+    ind_dist.clear();
+    for (size_t i=0; i<heap.size(); i++){
+        ind_dist.push_back(static_cast<T>(heap[i].second));
+        ind_dist.push_back(std::sqrt(heap[i].first));
+    }
+    heap.clear();
+}
+
+// writes the indices and distances, nearest first. Returns their number. Empties the heap.
+template <typename T>
+int KnnHeap<T>::write(int32_t* indices, T* distances){
+    std::sort_heap(heap.begin(), heap.end());
+    int n = static_cast<int>(heap.size());
+    for (int i=0; i<n; i++){
+        indices[i] = heap[i].second;
+        distances[i] = std::sqrt(heap[i].first);
+    }
+    heap.clear();
+    return n;
+}
+
+#endif /* KnnHeap_hpp */
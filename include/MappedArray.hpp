@@ -0,0 +1,60 @@
+//
+//  MappedArray.hpp
+//
+//  MappedArray holds a read-only array of plain records (e.g. KdNode) that is either
+//      - owned (moved in from a vector), or
+//      - used in place from a mapped file (MappedFile.hpp), e.g. a binary model file.
+//
+//  Copies share the mapped file, so the array stays valid as long as any copy is alive.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef MappedArray_hpp
+#define MappedArray_hpp
+
+#include <memory>
+#include <vector>
+#include "MappedFile.hpp"
+
+template <typename E>
+class MappedArray{
+
+public:
+
+    MappedArray(): mapped(nullptr), n(0){}
+
+    void assign(std::vector<E> && values); // takes ownership of the values
+    void attach(std::shared_ptr<MappedFile> file, size_t offset, size_t count); // uses count records at offset in file
+
+    const E& operator[](size_t i) const { return data()[i]; }
+    const E* data() const { return mapping ? mapped : owned.data(); }
+    size_t size() const { return mapping ? n : owned.size(); }
+    bool empty() const { return size() == 0; }
+    bool isMapped() const { return mapping != nullptr; }
+
+private:
+    std::vector<E> owned;
+    std::shared_ptr<MappedFile> mapping;
+    const E* mapped; // first record in the mapped file
+    size_t n; // number of records in the mapped file
+};
+
+// takes ownership of the values
+template <typename E>
+void MappedArray<E>::assign(std::vector<E> && values){
+    mapping.reset();
+    owned = std::move(values);
+}
+
+// uses count records at offset in file, without copying
+template <typename E>
+void MappedArray<E>::attach(std::shared_ptr<MappedFile> file, size_t offset, size_t count){
+    owned.clear();
+    mapping = file;
+    mapped = reinterpret_cast<const E*>(file->data() + offset);
+    n = count;
+}
+
+#endif /* MappedArray_hpp */
@@ -0,0 +1,142 @@
+//
+//  MappedFile.hpp
+//
+//  MappedFile maps a whole file read-only into memory (mmap), so that it can be parsed
+//  or accessed in place without reading it through a stream.
+//
+//  If the file cannot be mapped (e.g. a pipe), its content is read into a private buffer instead,
+//  so data() and size() behave the same in both cases.
+//
+//  e.g.    MappedFile file;
+//          if (!file.open(fileName)) throw std::runtime_error("Couldn't open " + fileName);
+//          parse(file.data(), file.data() + file.size());
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef MappedFile_hpp
+#define MappedFile_hpp
+
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class MappedFile{
+
+public:
+
+    MappedFile(); // constructor
+    ~MappedFile(); // destructor. Unmaps the file.
+
+    bool open(const std::string & fileName); // maps the file. Returns false if it cannot be opened.
+    void close(); // unmaps the file
+
+    const char* data() const; // first byte of the file
+    size_t size() const; // size of the file in bytes
+    bool isMapped() const; // whether the content is mapped (rather than copied)
+
+    void adviseSequential() const; // hint: the file will be read once from the front to the back
+    void adviseRandom() const; // hint: the file will be accessed at random positions
+
+private:
+
+    MappedFile(const MappedFile &); // not copyable
+    MappedFile & operator=(const MappedFile &);
+
+    const char* ptr;
+    size_t len;
+    bool mapped;
+    std::vector<char> buffer; // used when the file cannot be mapped
+};
+
+// constructor
+inline MappedFile::MappedFile(): ptr(nullptr), len(0), mapped(false){
+}
+
+// destructor
+inline MappedFile::~MappedFile(){
+    close();
+}
+
+// maps the file read-only.
+// Regular files are mapped, anything else (pipes, character devices) is read into a buffer.
+inline bool MappedFile::open(const std::string & fileName){
+
+    close();
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        len = static_cast<size_t>(st.st_size);
+        if (len == 0){ // nothing to map
+            ::close(fd);
+            return true;
+        }
+        void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED){
+            ptr = static_cast<const char*>(p);
+            mapped = true;
+            ::close(fd);
+            return true;
+        }
+    }
+
+    // fall back to reading the content
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+        buffer.insert(buffer.end(), chunk, chunk + n);
+    ::close(fd);
+    if (n < 0){
+        buffer.clear();
+        return false;
+    }
+    ptr = buffer.data();
+    len = buffer.size();
+    return true;
+}
+
+// unmaps the file
+inline void MappedFile::close(){
+    if (mapped)
+        munmap(const_cast<char*>(ptr), len);
+    buffer.clear();
+    ptr = nullptr;
+    len = 0;
+    mapped = false;
+}
+
+// first byte of the file
+inline const char* MappedFile::data() const{
+    return ptr;
+}
+
+// size of the file in bytes
+inline size_t MappedFile::size() const{
+    return len;
+}
+
+// whether the content is mapped (rather than copied)
+inline bool MappedFile::isMapped() const{
+    return mapped;
+}
+
+// hint: the file will be read once from the front to the back
+inline void MappedFile::adviseSequential() const{
+    if (mapped)
+        madvise(const_cast<char*>(ptr), len, MADV_SEQUENTIAL);
+}
+
+// hint: the file will be accessed at random positions
+inline void MappedFile::adviseRandom() const{
+    if (mapped)
+        madvise(const_cast<char*>(ptr), len, MADV_RANDOM);
+}
+
+#endif /* MappedFile_hpp */
@@ -0,0 +1,124 @@
+//
+//  QueryClient.hpp
+//
+//  QueryClient sends requests to a query_server (QueryServer.hpp) over its Unix domain socket, in the messages of
+//  QueryProtocol.hpp, and returns the answers. One QueryClient is one connection, to be used by one thread at a time.
+//
+//  The results of a batch of queries come in three arrays: counts[i] points were found for query i, and their indices
+//  and distances follow those of the previous queries in indices and distances, nearest first.
+//  An error reported by the server, or a failed connection, throws std::runtime_error.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef QueryClient_hpp
+#define QueryClient_hpp
+
+#include "QueryProtocol.hpp"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class QueryClient{
+
+public:
+    explicit QueryClient(const std::string & socketPath); // connects to the server
+    ~QueryClient();
+    QueryClient(const QueryClient &) = delete;
+    QueryClient & operator=(const QueryClient &) = delete;
+
+    // the k nearest points of numQueries x dim query values, row by row
+    void knnSearch(const float* queries, int numQueries, int dim, int k,
+                   std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances);
+    // the points within radius of every query, or the maxCount nearest of them if maxCount > 0
+    void radiusSearch(const float* queries, int numQueries, int dim, float radius, int maxCount,
+                      std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances);
+    // makes the server load a new model (with its train data, or '-' if the model embeds the points)
+    void reload(const std::string & modelFileName, const std::string & trainFileName);
+
+private:
+    void send(const queryProtocol::RequestHeader & request, const void* payload, size_t size);
+    void receive(std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances);
+
+    int fd = -1;
+};
+
+inline QueryClient::QueryClient(const std::string & socketPath){
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Invalid socket path: " + socketPath);
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't create the socket.");
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0){
+        ::close(fd);
+        throw std::runtime_error("Couldn't connect to " + socketPath + ": " + std::strerror(errno));
+    }
+}
+
+inline QueryClient::~QueryClient(){
+    ::close(fd);
+}
+
+inline void QueryClient::knnSearch(const float* queries, int numQueries, int dim, int k,
+                                   std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances){
+    queryProtocol::RequestHeader request = {queryProtocol::magic, queryProtocol::knnRequest, numQueries, dim, k, -1};
+    send(request, queries, static_cast<size_t>(numQueries) * dim * sizeof(float));
+    receive(counts, indices, distances);
+}
+
+inline void QueryClient::radiusSearch(const float* queries, int numQueries, int dim, float radius, int maxCount,
+                                      std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances){
+    queryProtocol::RequestHeader request = {queryProtocol::magic, queryProtocol::radiusRequest, numQueries, dim, maxCount, radius};
+    send(request, queries, static_cast<size_t>(numQueries) * dim * sizeof(float));
+    receive(counts, indices, distances);
+}
+
+inline void QueryClient::reload(const std::string & modelFileName, const std::string & trainFileName){
+    std::string paths = modelFileName + "\n" + trainFileName;
+    queryProtocol::RequestHeader request = {queryProtocol::magic, queryProtocol::reloadRequest,
+                                            static_cast<int32_t>(paths.size()), 0, 0, -1};
+    send(request, paths.data(), paths.size());
+    std::vector<int32_t> counts, indices;
+    std::vector<float> distances;
+    receive(counts, indices, distances);
+}
+
+// Sends the header of a request and its values.
+inline void QueryClient::send(const queryProtocol::RequestHeader & request, const void* payload, size_t size){
+    if (!queryProtocol::writeAll(fd, &request, sizeof(request)) || !queryProtocol::writeAll(fd, payload, size))
+        throw std::runtime_error("The connection to the server was lost.");
+}
+
+// Reads a response into counts, indices and distances, or throws the error it reports.
+inline void QueryClient::receive(std::vector<int32_t> & counts, std::vector<int32_t> & indices, std::vector<float> & distances){
+    using namespace queryProtocol;
+    ResponseHeader response;
+    if (!readAll(fd, &response, sizeof(response)) || response.magic != magic)
+        throw std::runtime_error("The connection to the server was lost.");
+    if (response.status != ok){
+        std::string message(static_cast<size_t>(response.numFound), '\0');
+        if (!readAll(fd, &message[0], message.size()))
+            throw std::runtime_error("The connection to the server was lost.");
+        throw std::runtime_error(message);
+    }
+    counts.resize(response.numQueries);
+    indices.resize(static_cast<size_t>(response.numFound));
+    distances.resize(static_cast<size_t>(response.numFound));
+    if (!readAll(fd, counts.data(), counts.size() * sizeof(int32_t))
+        || !readAll(fd, indices.data(), indices.size() * sizeof(int32_t))
+        || !readAll(fd, distances.data(), distances.size() * sizeof(float)))
+        throw std::runtime_error("The connection to the server was lost.");
+}
+
+#endif /* QueryClient_hpp */
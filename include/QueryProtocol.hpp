@@ -0,0 +1,90 @@
+//
+//  QueryProtocol.hpp
+//
+//  The messages between query_server and its clients over a Unix domain socket (QueryServer.hpp, query_client).
+//  Both ends run on the same host, so the values are sent in its byte order, as they are in memory.
+//
+//  A client sends requests on its connection, one at a time, and reads the response of each:
+//      - knnRequest:    RequestHeader, then numQueries x dim float values, row by row. The k nearest points of every query.
+//      - radiusRequest: the same, for the points within radius of every query (at most k of them if k > 0).
+//      - reloadRequest: RequestHeader, then numQueries bytes: the path of the model, '\n', the path of the train data
+//                       ('-' if the model embeds the points). The server loads them and answers the next requests
+//                       with the new tree; the requests being answered finish with the old one.
+//  The response is a ResponseHeader, then
+//      - if status is ok: numQueries int32 counts (the number of points found for every query),
+//        numFound int32 indices, then numFound float distances: the points of every query one after the other, nearest first.
+//      - otherwise: numFound bytes of error message. The connection stays open.
+//  A request that is not understood (wrong magic, sizes out of range) closes the connection.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef QueryProtocol_hpp
+#define QueryProtocol_hpp
+
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace queryProtocol{
+
+const uint32_t magic = 0x3151444b; // "KDQ1"
+const int32_t maxValues = 1 << 28; // at most numQueries x dim values in a request
+
+enum RequestType : int32_t { knnRequest = 1, radiusRequest = 2, reloadRequest = 3 };
+enum Status : int32_t { ok = 0, failed = 1 };
+
+struct RequestHeader{
+    uint32_t magic;
+    int32_t type; // RequestType
+    int32_t numQueries; // bytes of the paths for reloadRequest
+    int32_t dim; // values per query
+    int32_t k; // neighbours per query; for radiusRequest, at most k points per query if k > 0
+    float radius; // radiusRequest only
+};
+
+struct ResponseHeader{
+    uint32_t magic;
+    int32_t status; // Status
+    int32_t numQueries;
+    int32_t reserved;
+    int64_t numFound; // total number of points found, or bytes of the error message
+};
+
+// Reads exactly size bytes. Returns false if the connection is closed or fails first.
+inline bool readAll(int fd, void* buffer, size_t size){
+    char* p = static_cast<char*>(buffer);
+    while (size > 0){
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Writes exactly size bytes. Returns false if the connection is closed or fails first (without SIGPIPE).
+inline bool writeAll(int fd, const void* buffer, size_t size){
+    const char* p = static_cast<const char*>(buffer);
+    while (size > 0){
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+}
+
+#endif /* QueryProtocol_hpp */
@@ -0,0 +1,323 @@
+//
+//  QueryServer.hpp
+//
+//  QueryServer holds one loaded tree and answers the requests of many local clients over a Unix domain socket
+//  (query_server), in the messages of QueryProtocol.hpp, so that the clients share one copy of the tree and its points.
+//
+//  Every connection has a thread which reads its requests. The queries of a request are split into chunks that are
+//  searched by a WorkerPool (parallel.hpp) shared by all the connections, so a large batch is spread over the pool while
+//  the total number of searching threads stays fixed.
+//
+//  The tree is replaced atomically, as in DynamicKdTree: it is held by a shared_ptr, which a request
+//  reads once (std::atomic_load) and uses to the end. load(...) reads the new model while the old one keeps answering,
+//  then publishes it (std::atomic_store); the old one is freed when its last request is done. No connection is dropped.
+//  If the new model cannot be loaded, the old one stays. The tree keeps its own copy of the points it needs,
+//  so the train data is freed as soon as the model is loaded.
+//
+//  serve() accepts connections until stop(), which may be called from another thread.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef QueryServer_hpp
+#define QueryServer_hpp
+
+#include "CSVTable.hpp"
+#include "KdTree.hpp"
+#include "QueryProtocol.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class QueryServer{
+
+public:
+    typedef KdTree<float, CSVTable<float>> Tree;
+
+    QueryServer(const std::string & socketPath, int numThreads = parallel::defaultThreads());
+    ~QueryServer(); // stops serving and removes the socket file
+    QueryServer(const QueryServer &) = delete;
+    QueryServer & operator=(const QueryServer &) = delete;
+
+    // loads the model (with its train data, or '-' if the model embeds the points) and answers the next requests with it
+    void load(const std::string & modelFileName, const std::string & trainFileName);
+    // approximate search for the trees loaded from now on, as in query_kdtree (bound > 0, epsilon > 0, maxChecks > 0)
+    void setSearch(float bound, float epsilon, int maxChecks);
+    void serve(); // accepts connections until stop()
+    void stop(); // stops accepting, closes the connections after their current request
+
+    int numPoints() const; // points of the current tree
+    int dim() const; // dimension of the current tree
+
+private:
+    std::shared_ptr<const Tree> current() const;
+    void handle(int fd); // answers the requests of one connection until it closes
+    bool answerSearch(int fd, const queryProtocol::RequestHeader & request, const vector<float> & queries);
+    bool answerReload(int fd, const std::string & paths);
+    bool sendError(int fd, const std::string & message);
+
+    const int chunkSize = 64; // queries per task of the pool
+    std::string socketPath;
+    int listenFd = -1;
+    parallel::WorkerPool pool;
+    std::shared_ptr<const Tree> index; // read and written atomically
+    std::mutex loadMutex; // one load at a time
+    float bound = -1;
+    float epsilon = 0;
+    int maxChecks = 0;
+
+    std::mutex connectionMutex;
+    std::condition_variable allClosed; // the last connection closed
+    std::atomic<bool> stopping;
+    std::set<int> connections; // open connections, each read by its own (detached) thread
+};
+
+// Binds the socket at socketPath (replacing a stale socket file) and starts the pool of numThreads threads.
+inline QueryServer::QueryServer(const std::string & socketPath, int numThreads)
+    : socketPath(socketPath), pool(numThreads), stopping(false){
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Invalid socket path: " + socketPath);
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw std::runtime_error("Couldn't create the socket.");
+    ::unlink(socketPath.c_str());
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listenFd, 64) != 0){
+        ::close(listenFd);
+        throw std::runtime_error("Couldn't listen on " + socketPath + ": " + std::strerror(errno));
+    }
+}
+
+inline QueryServer::~QueryServer(){
+    stop();
+    std::unique_lock<std::mutex> lock(connectionMutex);
+    allClosed.wait(lock, [this](){ return connections.empty(); });
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+}
+
+// Loads the new model while the current one keeps answering, then publishes it. Throws if it cannot be loaded.
+// The train data is only read while the tree gathers its points (KdTree::attachPoints(...)), and freed on return.
+inline void QueryServer::load(const std::string & modelFileName, const std::string & trainFileName){
+    std::lock_guard<std::mutex> lock(loadMutex);
+    std::shared_ptr<Tree> next(new Tree());
+    if (trainFileName != "-"){
+        CSVTable<float> trainTable(trainFileName, parallel::defaultThreads());
+        next->load(modelFileName, &trainTable);
+    }
+    else
+        next->load(modelFileName);
+    if (bound > 0){
+        next->setBound(bound);
+        next->setSearchMode(Tree::boundedSearch);
+    }
+    if (epsilon > 0)
+        next->setEpsilon(epsilon);
+    if (maxChecks > 0)
+        next->setMaxChecks(maxChecks);
+    std::atomic_store(&index, std::shared_ptr<const Tree>(next));
+}
+
+inline void QueryServer::setSearch(float bound, float epsilon, int maxChecks){
+    std::lock_guard<std::mutex> lock(loadMutex);
+    this->bound = bound;
+    this->epsilon = epsilon;
+    this->maxChecks = maxChecks;
+}
+
+inline std::shared_ptr<const QueryServer::Tree> QueryServer::current() const{
+    return std::atomic_load(&index);
+}
+
+inline int QueryServer::numPoints() const{
+    std::shared_ptr<const Tree> now = current();
+    return now ? now->numPoints() : 0;
+}
+
+inline int QueryServer::dim() const{
+    std::shared_ptr<const Tree> now = current();
+    return now ? now->getPoints().dim() : 0;
+}
+
+// Accepts connections, each answered by its own thread, until stop().
+inline void QueryServer::serve(){
+    while (!stopping){
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0){
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // stop() shut the socket down
+        }
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        if (stopping){
+            ::close(fd);
+            break;
+        }
+        connections.insert(fd);
+        std::thread([this, fd](){
+            handle(fd);
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            connections.erase(fd);
+            ::close(fd);
+            if (connections.empty())
+                allClosed.notify_all();
+        }).detach();
+    }
+}
+
+// Wakes serve() and the connections waiting for a request; they close once their current request is answered.
+inline void QueryServer::stop(){
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    stopping = true;
+    ::shutdown(listenFd, SHUT_RDWR);
+    for (int fd : connections)
+        ::shutdown(fd, SHUT_RD);
+}
+
+// Reads and answers requests until the connection closes or sends a request that is not understood.
+inline void QueryServer::handle(int fd){
+    using namespace queryProtocol;
+    vector<float> queries;
+    RequestHeader request;
+    while (!stopping && readAll(fd, &request, sizeof(request))){
+        if (request.magic != magic || request.numQueries < 0)
+            return;
+        if (request.type == reloadRequest){
+            std::string paths(static_cast<size_t>(request.numQueries), '\0');
+            if (!readAll(fd, &paths[0], paths.size()) || !answerReload(fd, paths))
+                return;
+            continue;
+        }
+        if ((request.type != knnRequest && request.type != radiusRequest) || request.dim <= 0
+            || static_cast<int64_t>(request.numQueries) * request.dim > maxValues)
+            return;
+        queries.resize(static_cast<size_t>(request.numQueries) * request.dim);
+        if (!readAll(fd, queries.data(), queries.size() * sizeof(float)) || !answerSearch(fd, request, queries))
+            return;
+    }
+}
+
+// Searches the queries of a request on the pool and sends the response. Returns false if the connection failed.
+inline bool QueryServer::answerSearch(int fd, const queryProtocol::RequestHeader & request, const vector<float> & queries){
+    using namespace queryProtocol;
+    std::shared_ptr<const Tree> now = current(); // the whole request is answered by the same tree
+    if (!now)
+        return sendError(fd, "No model is loaded.");
+    const Tree & tree = *now;
+    if (request.dim != tree.getPoints().dim())
+        return sendError(fd, "The queries have " + std::to_string(request.dim) + " values, the tree "
+                         + std::to_string(tree.getPoints().dim()) + ".");
+    if (request.type == knnRequest && request.k <= 0)
+        return sendError(fd, "k must be positive.");
+    if (request.type == radiusRequest && !(request.radius >= 0))
+        return sendError(fd, "The radius must not be negative.");
+
+    int numQueries = request.numQueries;
+    int numChunks = (numQueries + chunkSize - 1) / chunkSize;
+    vector<int32_t> counts(numQueries);
+    // the points found by every chunk, queries one after the other
+    vector<vector<int32_t>> indices(numChunks);
+    vector<vector<float>> distances(numChunks);
+    try{
+        pool.run(numChunks, [&](int chunk){
+            int begin = chunk * chunkSize;
+            int end = std::min(numQueries, begin + chunkSize);
+            vector<int32_t> & chunkIndices = indices[chunk];
+            vector<float> & chunkDistances = distances[chunk];
+            if (request.type == knnRequest){
+                int k = std::min(request.k, tree.numPoints());
+                chunkIndices.resize(static_cast<size_t>(end - begin) * k);
+                chunkDistances.resize(chunkIndices.size());
+                // a query may find fewer than k points (boundedSearch): the next one is written right after them
+                size_t filled = 0;
+                for (int i=begin; i<end; i++){
+                    const RowView<float> testPoint(&queries[static_cast<size_t>(i) * request.dim], request.dim);
+                    counts[i] = tree.knnSearch(testPoint, k, &chunkIndices[filled], &chunkDistances[filled]);
+                    filled += counts[i];
+                }
+                chunkIndices.resize(filled);
+                chunkDistances.resize(filled);
+            }
+            else{
+                for (int i=begin; i<end; i++){
+                    const RowView<float> testPoint(&queries[static_cast<size_t>(i) * request.dim], request.dim);
+                    counts[i] = tree.radiusSearch(testPoint, request.radius, chunkIndices, chunkDistances, std::max(request.k, 0));
+                }
+            }
+        });
+    }
+    catch (const std::exception & e){
+        return sendError(fd, std::string("The search failed: ") + e.what());
+    }
+
+    ResponseHeader response;
+    std::memset(&response, 0, sizeof(response));
+    response.magic = magic;
+    response.status = ok;
+    response.numQueries = numQueries;
+    for (int32_t count : counts)
+        response.numFound += count;
+    if (!writeAll(fd, &response, sizeof(response)) || !writeAll(fd, counts.data(), counts.size() * sizeof(int32_t)))
+        return false;
+    for (auto & chunk : indices){
+        if (!writeAll(fd, chunk.data(), chunk.size() * sizeof(int32_t)))
+            return false;
+    }
+    for (auto & chunk : distances){
+        if (!writeAll(fd, chunk.data(), chunk.size() * sizeof(float)))
+            return false;
+    }
+    return true;
+}
+
+// Loads the model of a reload request ("model path\ntrain data path") and answers with no queries, or the error.
+inline bool QueryServer::answerReload(int fd, const std::string & paths){
+    using namespace queryProtocol;
+    size_t newline = paths.find('\n');
+    if (newline == std::string::npos)
+        return sendError(fd, "A reload request needs the path of the model and of the train data.");
+    try{
+        load(paths.substr(0, newline), paths.substr(newline + 1));
+    }
+    catch (const std::exception & e){
+        return sendError(fd, std::string("Couldn't reload: ") + e.what());
+    }
+
+    ResponseHeader response;
+    std::memset(&response, 0, sizeof(response));
+    response.magic = magic;
+    response.status = ok;
+    return writeAll(fd, &response, sizeof(response));
+}
+
+// Sends an error response. Returns false if the connection failed.
+inline bool QueryServer::sendError(int fd, const std::string & message){
+    using namespace queryProtocol;
+    ResponseHeader response;
+    std::memset(&response, 0, sizeof(response));
+    response.magic = magic;
+    response.status = failed;
+    response.numFound = static_cast<int64_t>(message.size());
+    return writeAll(fd, &response, sizeof(response)) && writeAll(fd, message.data(), message.size());
+}
+
+#endif /* QueryServer_hpp */
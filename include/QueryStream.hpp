@@ -0,0 +1,112 @@
+//
+//  QueryStream.hpp
+//
+//  QueryStream answers query points as they arrive, one line at a time, with a tree loaded once
+//  (query_kdtree --stream). The points of the tree may have a fixed dimension (Table = CSVTable<T, D>).
+//
+//  Every non-blank input line is a query point, with the values separated by commas as in the .csv data.
+//  It is answered by one output line, in the format of QueryTable (or RadiusQueryTable with a radius):
+//      indice1,distance1,indice2,distance2,... nearest first.
+//  A line that is not a point of the tree's dimension gets an empty output line, so that the output lines still
+//  match the input lines, and the error is reported on the error stream. Blank lines are skipped.
+//
+//  An answer does not wait for the next query: the output is flushed whenever no more input is already
+//  buffered, so a query that arrives alone is answered at once, while a burst of queries is written in one go.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef QueryStream_hpp
+#define QueryStream_hpp
+
+#include "CSVTable.hpp"
+#include "KdTree.hpp"
+#include "csvParser.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+template <typename T, class Table = CSVTable<T>>
+class QueryStream{
+
+public:
+
+    // k nearest points, or the points within radius (at most k of them if maxCount) if radius >= 0
+    QueryStream(const KdTree<T, Table>& trainTree, int k = 1, T radius = -1, bool maxCount = false);
+
+    // answers every line of in on out, until in ends. Returns the number of queries answered.
+    long run(std::istream & in, std::ostream & out, std::ostream & errors = std::cerr);
+
+private:
+    bool answer(const std::string & line, long lineNum, std::ostream & out, std::ostream & errors);
+
+    const KdTree<T, Table> & tree;
+    int numNeighbours;
+    T radius;
+    int maxCount; // for the radius search, 0: no limit
+    vector<T> point; // the query being answered
+    vector<int32_t> indices; // its result
+    vector<T> distances;
+};
+
+template <typename T, class Table>
+QueryStream<T, Table>::QueryStream(const KdTree<T, Table>& trainTree, int k, T radius, bool maxCount)
+    : tree(trainTree), numNeighbours(std::min(std::max(k, 1), trainTree.numPoints())), radius(radius),
+      maxCount(maxCount ? std::max(k, 1) : 0){
+    point.resize(tree.getPoints().dim());
+    indices.resize(numNeighbours);
+    distances.resize(numNeighbours);
+}
+
+// Answers every line of in on out, until in ends. The output is flushed whenever no more input is buffered.
+template <typename T, class Table>
+long QueryStream<T, Table>::run(std::istream & in, std::ostream & out, std::ostream & errors){
+    long answered = 0;
+    long lineNum = 0;
+    for (std::string line; std::getline(in, line); ){
+        lineNum++;
+        if (csvParser::isBlankLine(line.data(), line.data() + line.size()))
+            continue;
+        if (answer(line, lineNum, out, errors))
+            answered++;
+        if (in.rdbuf()->in_avail() <= 0)
+            out.flush();
+    }
+    out.flush();
+    return answered;
+}
+
+// Writes the result of the query of one line, or an empty line if it is not a point. Returns whether it was.
+template <typename T, class Table>
+bool QueryStream<T, Table>::answer(const std::string & line, long lineNum, std::ostream & out, std::ostream & errors){
+    try{
+        csvParser::parseRows(line.data(), line.data() + line.size(), static_cast<int>(point.size()), point.data(), lineNum, "input");
+    }
+    catch (const std::runtime_error & e){
+        errors << e.what() << "\n";
+        out << "\n";
+        return false;
+    }
+
+    const RowView<T> testPoint(point);
+    int n;
+    if (radius >= 0){
+        indices.clear();
+        distances.clear();
+        n = tree.radiusSearch(testPoint, radius, indices, distances, maxCount);
+    }
+    else
+        n = tree.knnSearch(testPoint, numNeighbours, indices.data(), distances.data());
+    for (int j=0; j<n; j++){
+        out << indices[j] << "," << distances[j];
+        if (j < n-1) out << ",";
+    }
+    out << "\n";
+    return true;
+}
+
+#endif /* QueryStream_hpp */
@@ -1,7 +1,32 @@
 //
 //  QueryTable.hpp
 //
-//  
+//  QueryTable holds the result of the search of every query point in the trainTree, one row per query:
+//      - k = 1 (default): the nearest point found by traverseTree(...): indice,distance
+//      - k > 1: the k nearest points found by knnSearch(...), nearest first: indice1,distance1,indice2,distance2,...
+//  The search is exact unless the trainTree is set to the approximate boundedSearch mode.
+//
+//  The results are stored in two flat arrays allocated once (k slots per query), which the searches write into,
+//  so that querying does not allocate memory per query. The indices are kept as integers, so they are written exactly.
+//  A query may find fewer than k points (the approximate boundedSearch mode); the number found is kept per query,
+//  and only those are written and counted by recall(...).
+//
+//  The queries can be searched on several threads (numThreads). They are split into chunks of consecutive queries,
+//  and each thread claims the next unclaimed chunk (parallel.hpp), so that a thread slowed down by hard queries
+//  does not hold the others back. Each query writes to its own slots, so the rows keep the order of testTable.
+//
+//  With reorder, the queries are searched in the order of their Morton code within the bounding box of the tree's points
+//  (spaceFillingCurve.hpp) rather than in the order of testTable. Consecutive queries are then close in space and
+//  go through mostly the same nodes and points, which are still in the cache. The results are still written to
+//  the slots of their queries, so they come out in the order of testTable, and are the same.
+//
+//  With a query tree (a KdTree of the test data), all the queries are searched at once by traversing both trees together
+//  (DualTreeSearch.hpp), which pays off when there are about as many queries as train points. The rows are still in
+//  the order of the test data.
+//
+//  nodesPerQuery() tells how many nodes of the tree a query visited on average.
+//  recall(groundTruth) tells which share of the true neighbours an approximate search found (see KdTree.hpp).
+//
 //  Copyright © 2016 Serim Park . All rights reserved.
 //
 
@@ -10,9 +35,17 @@
 
 #include "CSVTable.hpp"
 #include "KdTree.hpp"
+#include "parallel.hpp"
+#include "spaceFillingCurve.hpp"
+#include "DualTreeSearch.hpp"
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <stdexcept>
 
 using std::cout;
 using std::endl;
@@ -23,17 +56,25 @@ class QueryTable{//: public CSVTable<T>{
     
 public:
     
-    QueryTable(const CSVTable<T>& testTable, const KdTree<T, CSVTable<T>>& trainTree, const CSVTable<T> * trainData);
+    template<class Table>
+    QueryTable(const CSVTable<T>& testTable, const KdTree<T, Table>& trainTree, int k = 1, int numThreads = 1, bool reorder = false);
+    template<class Table>
+    QueryTable(const KdTree<T, Table>& testTree, const KdTree<T, Table>& trainTree, int k = 1, int numThreads = 1);
     QueryTable();
     ~QueryTable();
     
     void write2CSV(std::ofstream &fout);
+    double nodesPerQuery() const; // average number of nodes of the tree (pairs of nodes with a query tree) visited by a query
+    double recall(const CSVTable<T>& groundTruth) const; // share of the true neighbours found
     
 private:
     
-    deque<vector<T>> queryTable;
-    int numCol;
-    int numRow;
+    vector<int32_t> indices; // numRow x numNeighbours indices in the train data, nearest first
+    vector<T> distances; // the corresponding distances
+    vector<int32_t> counts; // numRow numbers of neighbours found, at most numNeighbours
+    int numNeighbours = 0; // neighbours per query
+    int numRow = 0;
+    int64_t visitedNodes = 0; // nodes visited by all the queries
 };
 
 
@@ -45,31 +86,106 @@ template <typename T>
 QueryTable<T>::~QueryTable(){
 }
 
+// searches every row of testTable in trainTree, for the nearest point (k = 1) or the k nearest points,
+// on up to numThreads threads, in the order of testTable or, with reorder, in Morton order.
+// The points of trainTree may have a fixed dimension (CSVTable<T, D>).
 template <typename T>
-QueryTable<T>::QueryTable(const CSVTable<T>& testTable, const KdTree<T, CSVTable<T>>& trainTree, const CSVTable<T> * trainData){
+template <class Table>
+QueryTable<T>::QueryTable(const CSVTable<T>& testTable, const KdTree<T, Table>& trainTree, int k, int numThreads, bool reorder){
     
-    for(int i=0; i<testTable.size(); i++){
-        vector<T> ind_dist;
-        const vector<T> testPoint = testTable.get(i);
-        trainTree.traverseTree(trainTree.getRoot(), testPoint, trainData, ind_dist);
-        queryTable.push_back(ind_dist);
-        
-        DEBUG_MSG(cout, "Query: " + to_string_with_precision(i,0)+ returnStringVector((testPoint)));
-        DEBUG_MSG(cout, "Closest to " + to_string_with_precision(ind_dist[0],2)+". Dist:" + to_string(ind_dist[1]));
-    }
-    numRow = static_cast<int>(queryTable.size());
-    numCol = static_cast<int>(queryTable[0].size());
+    numRow = testTable.size();
+    numNeighbours = std::min(std::max(k, 1), trainTree.numPoints());
+    indices.resize(static_cast<size_t>(numRow) * numNeighbours);
+    distances.resize(static_cast<size_t>(numRow) * numNeighbours);
+    counts.resize(numRow);
+
+    // about 8 chunks per thread, to balance uneven chunks, but not so small that claiming them costs
+    numThreads = std::max(numThreads, 1);
+    int chunkSize = std::min(1024, std::max(16, numRow / (numThreads * 8)));
+    int numChunks = (numRow + chunkSize - 1) / chunkSize;
+    vector<int> order; // the queries in the order they are searched, empty for the order of testTable
+    if (reorder && numRow > 1)
+        order = spaceFillingCurve::mortonOrder<T>(testTable, trainTree.boundingBox(), numThreads);
+
+    std::atomic<int64_t> visited(0);
+    parallel::forEach(numChunks, numThreads, [&](int chunk){
+        int64_t visitedBefore = KdTree<T, Table>::nodesVisited();
+        int end = std::min(numRow, (chunk + 1) * chunkSize);
+        for(int j=chunk * chunkSize; j<end; j++){
+            int i = order.empty() ? j : order[j];
+            const RowView<T> testPoint = testTable.row(i);
+            size_t slot = static_cast<size_t>(i) * numNeighbours;
+            counts[i] = trainTree.knnSearch(testPoint, numNeighbours, &indices[slot], &distances[slot]);
+
+            DEBUG_MSG(cout, "Query: " + to_string_with_precision(i,0)+ returnStringVector((testPoint.toVector())));
+            DEBUG_MSG(cout, "Closest to " + to_string(indices[slot])+". Dist:" + to_string(distances[slot]));
+        }
+        visited += KdTree<T, Table>::nodesVisited() - visitedBefore;
+    });
+    visitedNodes = visited;
 }
 
+// searches every point of testTree in trainTree, for the nearest point (k = 1) or the k nearest points,
+// by traversing the two trees together (dual-tree search) on up to numThreads threads.
+// Throws if trainTree is in boundedSearch or has a maximum number of checks, which the dual-tree search does not support.
+// The rows are in the order of the test data the testTree was built from.
+template <typename T>
+template <class Table>
+QueryTable<T>::QueryTable(const KdTree<T, Table>& testTree, const KdTree<T, Table>& trainTree, int k, int numThreads){
+
+    numRow = testTree.numPoints();
+    numNeighbours = std::min(std::max(k, 1), trainTree.numPoints());
+    indices.resize(static_cast<size_t>(numRow) * numNeighbours);
+    distances.resize(static_cast<size_t>(numRow) * numNeighbours);
+
+    counts.assign(numRow, numNeighbours); // the dual-tree search is exact or (1+epsilon)-approximate (it throws otherwise): k points
+    DualTreeSearch<T, Table> dualTree(testTree, trainTree);
+    dualTree.search(numNeighbours, indices.data(), distances.data(), numThreads);
+    visitedNodes = dualTree.pairsVisited();
+}
+
+// average number of nodes of the tree (pairs of nodes with a query tree) visited by a query
+template <typename T>
+double QueryTable<T>::nodesPerQuery() const{
+    return numRow > 0 ? static_cast<double>(visitedNodes) / numRow : 0;
+}
+
+
+// The share of the true neighbours that were found. groundTruth has one row per query, in the format of write2CSV
+// (e.g. the ground_truth files of examples/more_examples): indice1,distance1,indice2,distance2,...
+// For every query, the first t true neighbours are looked for among the found ones, t being the smaller of
+// the number of neighbours per query and the number in groundTruth: with a 1-NN ground truth, this is the recall
+// of the nearest neighbour.
+template <typename T>
+double QueryTable<T>::recall(const CSVTable<T>& groundTruth) const{
+    if (groundTruth.size() != numRow)
+        throw std::runtime_error("The ground truth has " + to_string(groundTruth.size()) + " rows for "
+                                 + to_string(numRow) + " queries.");
+    int numTrue = std::min(numNeighbours, groundTruth.dim() / 2);
+    if (numRow == 0 || numTrue == 0)
+        return 0;
+    int64_t hits = 0;
+    for (int i=0; i<numRow; i++){
+        const int32_t* found = &indices[static_cast<size_t>(i) * numNeighbours];
+        for (int j=0; j<numTrue; j++){
+            int32_t truth = static_cast<int32_t>(groundTruth.get(i, 2*j));
+            if (std::find(found, found + counts[i], truth) != found + counts[i])
+                hits++;
+        }
+    }
+    return static_cast<double>(hits) / (static_cast<double>(numRow) * numTrue);
+}
 
+// writes one row per query: indice1,distance1,indice2,distance2,... (the points found, nearest first)
 template <typename T>
 void QueryTable<T>::write2CSV(std::ofstream &fout){
     for (int i=0; i<numRow; i++){
-        for (int j=0; j<numCol; j++){
-            fout<< queryTable[i][j];
-            if(j< numCol-1) fout<<",";
+        for (int j=0; j<counts[i]; j++){
+            size_t slot = static_cast<size_t>(i) * numNeighbours + j;
+            fout<< indices[slot] << "," << distances[slot];
+            if(j< counts[i]-1) fout<<",";
         }
-        fout<<std::endl;
+        fout<<"\n";
     }
     fout.flush();
 }
@@ -0,0 +1,64 @@
+//
+//  RadiusList.hpp
+//
+//  RadiusList collects all the points within a radius of the query during a radius search.
+//
+//  It offers the same interface to the search as KnnHeap, with a fixed bound:
+//      - worst() is the squared radius, so the search prunes every subtree farther than the radius,
+//      - a candidate is kept if its squared distance is not greater than the squared radius.
+//  The candidates are kept in the order they are found; write(...) can sort them by distance
+//  (equal distances by indice, as KnnHeap).
+//  The distances are squared distances; write(...) takes their roots.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef RadiusList_hpp
+#define RadiusList_hpp
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+template <typename T>
+class RadiusList{
+
+public:
+
+    void reset(T squaredRadius); // empties the list and sets the squared radius
+    void push(T dist, int ind){ if (dist <= limit) found.push_back(std::make_pair(dist, ind)); } // offers a candidate (squared distance)
+    T worst() const { return limit; } // the squared radius
+    bool reaches(T dist) const { return dist <= limit; } // whether a point at that squared distance could be kept
+    bool full() const { return false; } // never: every point within the radius is kept
+    int size() const { return static_cast<int>(found.size()); }
+    // appends the indices and distances to indices and distances, nearest first if sorted. Empties the list.
+    void write(std::vector<int32_t> & indices, std::vector<T> & distances, bool sorted);
+
+private:
+    std::vector<std::pair<T, int>> found; // (distance, indice)
+    T limit = 0;
+};
+
+// empties the list and sets the squared radius
+template <typename T>
+void RadiusList<T>::reset(T squaredRadius){
+    found.clear();
+    limit = squaredRadius;
+}
+
+// appends the indices and distances, nearest first if sorted. Empties the list.
+template <typename T>
+void RadiusList<T>::write(std::vector<int32_t> & indices, std::vector<T> & distances, bool sorted){
+    if (sorted)
+        std::sort(found.begin(), found.end());
+    for (size_t i=0; i<found.size(); i++){
+        indices.push_back(found[i].second);
+        distances.push_back(std::sqrt(found[i].first));
+    }
+    found.clear();
+}
+
+#endif /* RadiusList_hpp */
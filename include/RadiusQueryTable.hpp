@@ -0,0 +1,109 @@
+//
+//  RadiusQueryTable.hpp
+//
+//  RadiusQueryTable holds the result of the radius search of every query point in the trainTree, one row per query:
+//  the points within the radius, nearest first: indice1,distance1,indice2,distance2,... (an empty row if none).
+//  With a maximum count (maxCount > 0), a row holds at most the maxCount nearest of them.
+//
+//  The rows have different lengths, so they are stored one after the other in two flat arrays,
+//  with the offset of every row (offsets[i] ... offsets[i+1]-1 are the results of query i).
+//
+//  The queries are searched on several threads (numThreads) the same way as QueryTable: by chunks of consecutive queries,
+//  claimed by the threads one after the other (parallel.hpp). Every chunk collects its rows in its own arrays,
+//  which are then concatenated in the order of the chunks, so the rows keep the order of testTable.
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef RadiusQueryTable_h
+#define RadiusQueryTable_h
+
+#include "CSVTable.hpp"
+#include "KdTree.hpp"
+#include "parallel.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+template <typename T>
+class RadiusQueryTable{
+
+public:
+
+    template<class Table>
+    RadiusQueryTable(const CSVTable<T>& testTable, const KdTree<T, Table>& trainTree, T radius, int maxCount = 0, int numThreads = 1);
+    ~RadiusQueryTable();
+
+    void write2CSV(std::ofstream &fout);
+    int64_t numFound() const; // number of points found for all the queries
+
+private:
+
+    vector<int64_t> offsets; // numRow + 1 offsets of the rows in indices and distances
+    vector<int32_t> indices; // the indices in the train data of the points found, row after row, nearest first
+    vector<T> distances; // the corresponding distances
+    int numRow = 0;
+};
+
+template <typename T>
+RadiusQueryTable<T>::~RadiusQueryTable(){
+}
+
+// searches every row of testTable in trainTree for the points within radius (at most maxCount if maxCount > 0),
+// on up to numThreads threads. The points of trainTree may have a fixed dimension (CSVTable<T, D>).
+template <typename T>
+template <class Table>
+RadiusQueryTable<T>::RadiusQueryTable(const CSVTable<T>& testTable, const KdTree<T, Table>& trainTree, T radius, int maxCount, int numThreads){
+
+    numRow = testTable.size();
+    offsets.assign(numRow + 1, 0);
+
+    // about 8 chunks per thread, to balance uneven chunks, but not so small that claiming them costs
+    numThreads = std::max(numThreads, 1);
+    int chunkSize = std::min(1024, std::max(16, numRow / (numThreads * 8)));
+    int numChunks = (numRow + chunkSize - 1) / chunkSize;
+
+    // the results of every chunk, and the number of points found per query
+    vector<vector<int32_t>> chunkIndices(numChunks);
+    vector<vector<T>> chunkDistances(numChunks);
+    parallel::forEach(numChunks, numThreads, [&](int chunk){
+        int end = std::min(numRow, (chunk + 1) * chunkSize);
+        for(int i=chunk * chunkSize; i<end; i++){
+            offsets[i + 1] = trainTree.radiusSearch(testTable.row(i), radius, chunkIndices[chunk], chunkDistances[chunk], maxCount);
+        }
+    });
+
+    for (int i=0; i<numRow; i++)
+        offsets[i + 1] += offsets[i];
+    indices.reserve(offsets[numRow]);
+    distances.reserve(offsets[numRow]);
+    for (int chunk=0; chunk<numChunks; chunk++){
+        indices.insert(indices.end(), chunkIndices[chunk].begin(), chunkIndices[chunk].end());
+        distances.insert(distances.end(), chunkDistances[chunk].begin(), chunkDistances[chunk].end());
+        vector<int32_t>().swap(chunkIndices[chunk]);
+        vector<T>().swap(chunkDistances[chunk]);
+    }
+}
+
+// number of points found for all the queries
+template <typename T>
+int64_t RadiusQueryTable<T>::numFound() const{
+    return offsets[numRow];
+}
+
+// writes one row per query: indice1,distance1,indice2,distance2,...
+template <typename T>
+void RadiusQueryTable<T>::write2CSV(std::ofstream &fout){
+    for (int i=0; i<numRow; i++){
+        for (int64_t slot=offsets[i]; slot<offsets[i + 1]; slot++){
+            fout<< indices[slot] << "," << distances[slot];
+            if(slot < offsets[i + 1] - 1) fout<<",";
+        }
+        fout<<"\n";
+    }
+    fout.flush();
+}
+
+#endif /* RadiusQueryTable_h */
@@ -0,0 +1,67 @@
+//
+//  TableView.hpp
+//
+//  Non-owning views into the contiguous buffer of a CSVTable.
+//
+//      - RowView: a single data point (a row). The values are contiguous.
+//      - ColView: a single feature (a column). The values are contiguous when the table keeps
+//                 a column-major mirror, otherwise they are strided by the number of columns.
+//
+//  A view never copies the data. It stays valid as long as the table it was taken from is alive
+//  and is not reloaded.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef TableView_hpp
+#define TableView_hpp
+
+#include <vector>
+
+using std::vector;
+
+template <typename T>
+class RowView{
+
+public:
+
+    RowView(): ptr(nullptr), n(0){}
+    RowView(const T* p, int len): ptr(p), n(len){}
+    template <class Alloc>
+    RowView(const vector<T, Alloc> & v): ptr(v.data()), n(static_cast<int>(v.size())){} // view of a vector
+
+    const T& operator[](int i) const { return ptr[i]; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + n; }
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    vector<T> toVector() const { return vector<T>(ptr, ptr + n); } // copy, e.g. for printing
+
+private:
+    const T* ptr;
+    int n;
+};
+
+template <typename T>
+class ColView{
+
+public:
+
+    ColView(): ptr(nullptr), n(0), stride(1){}
+    ColView(const T* p, int len, int step): ptr(p), n(len), stride(step){}
+
+    const T& operator[](int i) const { return ptr[static_cast<long>(i) * stride]; }
+    const T* data() const { return ptr; } // the first value. The values are contiguous only if contiguous().
+    int size() const { return n; }
+    bool contiguous() const { return stride == 1; }
+
+private:
+    const T* ptr;
+    int n;
+    int stride;
+};
+
+#endif /* TableView_hpp */
@@ -0,0 +1,126 @@
+//
+//  binaryFormat.hpp
+//
+//  Layout of the binary files used next to the .csv files.
+//
+//  Point file (e.g. sample_data.bin), the binary counterpart of a data .csv file:
+//      - a 64-byte PointFileHeader,
+//      - rows x dims values in row-major order, starting at header.dataOffset
+//        (a multiple of header.alignment, so the values can be used in place once the file is mapped).
+//
+//  Model file (e.g. model.kdt), the binary counterpart of the .csv KdTree model:
+//      - a 64-byte ModelFileHeader,
+//      - header.numNodes KdNode records (KdNode.hpp), i.e. the node pool in pre-order, at header.nodeOffset.
+//        Children are referred to by their position in the array, so the whole tree is written
+//        in one sequential write and used in place once the file is mapped.
+//      - numPoints 32-bit indices at header.idOffset: the indice in the train data of each point of the nodes,
+//        in the order of the nodes' blocks of points. numPoints is the sum of the nodes' counts.
+//      - header.checksum is the FNV-1a hash of the node records followed by the indices.
+//      - optionally (header.elemType != 0), the coordinates of the nodes' points at header.pointOffset:
+//        numPoints x dims values, in the order of the indices. Such a model does not need
+//        the train data to answer queries.
+//
+//  All integers are stored in the byte order of the machine that wrote the file.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef binaryFormat_hpp
+#define binaryFormat_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace binaryFormat{
+
+const char pointMagic[8] = {'K', 'D', 'P', 'O', 'I', 'N', 'T', 'S'};
+const uint32_t pointVersion = 1;
+
+// element types
+const uint32_t float32 = 1;
+const uint32_t float64 = 2;
+
+struct PointFileHeader{
+    char magic[8];          // pointMagic
+    uint32_t version;       // pointVersion
+    uint32_t elemType;      // float32 or float64
+    uint64_t rows;          // number of points
+    uint64_t dims;          // number of values per point
+    uint64_t alignment;     // the data offset is a multiple of this
+    uint64_t dataOffset;    // byte offset of the first value
+    uint8_t reserved[16];
+};
+static_assert(sizeof(PointFileHeader) == 64, "PointFileHeader must be 64 bytes");
+
+const char modelMagic[8] = {'K', 'D', 'T', 'R', 'E', 'E', 'M', 'D'};
+const uint32_t modelVersion = 4;
+
+struct ModelFileHeader{
+    char magic[8];          // modelMagic
+    uint32_t version;       // modelVersion
+    uint32_t nodeSize;      // sizeof(KdNode)
+    uint64_t numNodes;      // number of nodes
+    uint64_t nodeOffset;    // byte offset of the first node
+    uint64_t checksum;      // fnv1a(...) of the node records
+    uint32_t elemType;      // element type of the embedded points, 0 if the points are not embedded
+    uint32_t dims;          // dimension of the embedded points
+    uint64_t pointOffset;   // byte offset of the embedded points (aligned to 64 bytes)
+    uint64_t idOffset;      // byte offset of the indices of the points in the train data
+};
+static_assert(sizeof(ModelFileHeader) == 64, "ModelFileHeader must be 64 bytes");
+
+const uint64_t fnv1aBasis = 14695981039346656037ULL;
+
+// 64-bit FNV-1a hash of size bytes.
+// To hash several buffers as one, pass the hash of the previous ones as hash.
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = fnv1aBasis){
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++){
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// element type code of T
+template<typename T> uint32_t elementType();
+template<> inline uint32_t elementType<float>(){ return float32; }
+template<> inline uint32_t elementType<double>(){ return float64; }
+
+// size in bytes of an element type (0 if unknown)
+inline size_t elementSize(uint32_t elemType){
+    return elemType == float32 ? 4 : (elemType == float64 ? 8 : 0);
+}
+
+// rounds n up to a multiple of align
+inline uint64_t alignUp(uint64_t n, uint64_t align){
+    return (n + align - 1) / align * align;
+}
+
+// Whether count items of itemSize bytes starting at offset lie within a file of fileSize bytes.
+// The header fields are not trusted: the test cannot overflow, whatever their values.
+inline bool fitsInFile(uint64_t fileSize, uint64_t offset, uint64_t count, uint64_t itemSize){
+    if (offset > fileSize)
+        return false;
+    return itemSize == 0 || count <= (fileSize - offset) / itemSize;
+}
+
+// Whether the first bytes of a file (at least 8) are the given magic.
+inline bool hasMagic(const char* data, size_t size, const char* magic){
+    return size >= 8 && memcmp(data, magic, 8) == 0;
+}
+
+// Whether the file starts with the given magic. False if the file cannot be read.
+inline bool fileHasMagic(const std::string & fileName, const char* magic){
+    std::ifstream fin(fileName.c_str(), std::fstream::in | std::fstream::binary);
+    char head[8] = {0};
+    fin.read(head, 8);
+    return hasMagic(head, static_cast<size_t>(fin.gcount()), magic);
+}
+
+}
+
+#endif /* binaryFormat_hpp */
@@ -0,0 +1,251 @@
+//
+//  csvParser.hpp
+//
+//  Functions that parse numeric CSV text held in memory (e.g. a MappedFile)
+//  directly into a preallocated row-major buffer.
+//
+//  Parsing is done in two passes:
+//      (1) countRows(...) / countColumns(...) find the size of the table,
+//      (2) parseRows(...) writes the values in place, without allocating.
+//
+//  For parallel loading, splitLines(...) cuts the text into chunks at line boundaries,
+//  which can be counted and parsed independently.
+//
+//  Blank lines are skipped and "\r\n" line endings are accepted, as is one trailing comma at the end of a line
+//  (e.g. "1.5,2.5,", written by some exports), which ends the row rather than starting an empty value.
+//  A row with a missing, extra or malformed value is reported with its line number.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef csvParser_hpp
+#define csvParser_hpp
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+namespace csvParser{
+
+// Whether c is a blank that may surround a value.
+inline bool isBlank(char c){
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Finds the end of the line starting at p (the position of '\n', or end).
+inline const char* findLineEnd(const char* p, const char* end){
+    const char* q = static_cast<const char*>(memchr(p, '\n', end - p));
+    return q ? q : end;
+}
+
+// Whether the line [p, lineEnd) holds only blanks.
+inline bool isBlankLine(const char* p, const char* lineEnd){
+    while (p < lineEnd && isBlank(*p))
+        p++;
+    return p == lineEnd;
+}
+
+// Case-insensitive match of a lower-case word at p.
+inline bool matchWord(const char* p, const char* end, const char* word){
+    for (; *word; p++, word++){
+        if (p == end || (*p | 0x20) != *word)
+            return false;
+    }
+    return true;
+}
+
+// Parses a decimal number (e.g. "-1.5", "3.8e-01", "nan", "inf") starting at p.
+// Returns the position after the number, or nullptr if there is no number at p.
+//
+// Up to 19 significant digits are accumulated into an integer, which is scaled by an exact power of ten
+// when possible. The result is within one ulp of a correctly rounded double.
+template<typename T>
+const char* parseNumber(const char* p, const char* end, T & value){
+
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')){
+        negative = (*p == '-');
+        p++;
+    }
+
+    if (matchWord(p, end, "nan")){
+        value = std::numeric_limits<T>::quiet_NaN();
+        return p + 3;
+    }
+    if (matchWord(p, end, "inf")){
+        value = negative ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::infinity();
+        return matchWord(p, end, "infinity") ? p + 8 : p + 3;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0; // significant digits in mantissa
+    int exp10 = 0;
+    bool any = false;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++){
+        any = true;
+        if (digits < 19){
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        }
+        else
+            exp10++;
+    }
+    if (p < end && *p == '.'){
+        p++;
+        for (; p < end && *p >= '0' && *p <= '9'; p++){
+            any = true;
+            if (digits < 19){
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exp10--;
+            }
+        }
+    }
+    if (!any)
+        return nullptr;
+
+    if (p < end && (*p == 'e' || *p == 'E')){
+        const char* q = p + 1;
+        bool negExp = false;
+        if (q < end && (*q == '-' || *q == '+')){
+            negExp = (*q == '-');
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9'){
+            int e = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; q++){
+                if (e < 10000) e = e * 10 + (*q - '0');
+            }
+            exp10 += negExp ? -e : e;
+            p = q;
+        }
+    }
+
+    double v = static_cast<double>(mantissa);
+    if (mantissa == 0)
+        v = 0;
+    else if (exp10 >= 0 && exp10 <= 22)
+        v *= pow10[exp10];
+    else if (exp10 < 0 && exp10 >= -22)
+        v /= pow10[-exp10];
+    else
+        v *= std::pow(10.0, exp10);
+
+    value = static_cast<T>(negative ? -v : v);
+    return p;
+}
+
+// Counts the data rows (non-blank lines) in [begin, end).
+// If numLines is given, the total number of lines (including blank ones) is stored there.
+inline long countRows(const char* begin, const char* end, long* numLines = nullptr){
+    long rows = 0;
+    long lines = 0;
+    for (const char* p = begin; p < end; ){
+        const char* lineEnd = findLineEnd(p, end);
+        if (!isBlankLine(p, lineEnd))
+            rows++;
+        lines++;
+        p = lineEnd + 1;
+    }
+    if (numLines)
+        *numLines = lines;
+    return rows;
+}
+
+// Counts the values in the first non-blank line of [begin, end). A trailing comma does not count.
+inline int countColumns(const char* begin, const char* end){
+    for (const char* p = begin; p < end; ){
+        const char* lineEnd = findLineEnd(p, end);
+        if (!isBlankLine(p, lineEnd)){
+            const char* last = lineEnd;
+            while (isBlank(last[-1]))
+                last--;
+            if (last[-1] == ',')
+                last--;
+            int cols = 1;
+            for (; p < last; p++){
+                if (*p == ',') cols++;
+            }
+            return cols;
+        }
+        p = lineEnd + 1;
+    }
+    return 0;
+}
+
+// Splits [begin, end) into at most numChunks pieces of similar size, cut right after a '\n'.
+// Returns the numChunks+1 boundaries (the first is begin, the last is end). Chunks may be empty.
+inline std::vector<const char*> splitLines(const char* begin, const char* end, int numChunks){
+    std::vector<const char*> bounds(numChunks + 1, end);
+    bounds[0] = begin;
+    for (int i = 1; i < numChunks; i++){
+        const char* p = begin + (end - begin) / numChunks * i;
+        if (p < bounds[i-1])
+            p = bounds[i-1];
+        p = findLineEnd(p, end);
+        bounds[i] = (p < end) ? p + 1 : end;
+    }
+    return bounds;
+}
+
+// Throws the error for a malformed row.
+inline void fail(const std::string & fileName, long lineNum, const std::string & msg){
+    throw std::runtime_error(fileName + ":" + std::to_string(lineNum) + ": " + msg);
+}
+
+// Parses every non-blank line of [begin, end) as a row of numCol values, written to out row by row.
+// begin must be the start of a line, whose number in the file is firstLine (for error messages).
+// Returns the number of rows written.
+template<typename T>
+long parseRows(const char* begin, const char* end, int numCol, T* out, long firstLine, const std::string & fileName){
+
+    long row = 0;
+    long lineNum = firstLine;
+    for (const char* p = begin; p < end; lineNum++){
+        const char* lineEnd = findLineEnd(p, end);
+        if (isBlankLine(p, lineEnd)){
+            p = lineEnd + 1;
+            continue;
+        }
+
+        T* dst = out + row * numCol;
+        int col = 0;
+        while (true){
+            while (p < lineEnd && isBlank(*p)) p++;
+            if (col == numCol)
+                fail(fileName, lineNum, "expected " + std::to_string(numCol) + " values, found more");
+            const char* q = parseNumber(p, lineEnd, dst[col]);
+            if (q == nullptr)
+                fail(fileName, lineNum, "malformed value in column " + std::to_string(col + 1));
+            col++;
+            p = q;
+            while (p < lineEnd && isBlank(*p)) p++;
+            if (p == lineEnd)
+                break;
+            if (*p != ',')
+                fail(fileName, lineNum, "malformed value in column " + std::to_string(col));
+            p++;
+            if (isBlankLine(p, lineEnd)) // a trailing comma ends the row
+                break;
+        }
+        if (col != numCol)
+            fail(fileName, lineNum, "expected " + std::to_string(numCol) + " values, found " + std::to_string(col));
+
+        row++;
+        p = lineEnd + 1;
+    }
+    return row;
+}
+
+}
+
+#endif /* csvParser_hpp */
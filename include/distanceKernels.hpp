@@ -0,0 +1,241 @@
+//
+//  distanceKernels.hpp
+//
+//  Squared Euclidean distance between two points, the inner loop of every query.
+//
+//      - squared(a, b, n, limit): the squared distance between a[0..n-1] and b[0..n-1].
+//        The sum is abandoned as soon as a partial sum exceeds limit (partial-distance early exit):
+//        the result is then some value greater than limit, which is all a search needs to reject the point.
+//        This only pays off for high-dimensional points, so the partial sum is checked every 32 dimensions.
+//
+//      - squaredDim<D>(a, b, n, limit): the same for points whose dimension D is known at compile time
+//        (CSVTable<T, D>), D = 0 meaning n. Low-dimensional points (D < 32) are compared by a loop of D steps,
+//        which the compiler unrolls and inlines into the search, without the call through the selected kernel.
+//
+//  Distances are kept squared during the search; the root is taken only for the results.
+//
+//  For float, the kernel is chosen once, at the first call, for the running processor:
+//      AVX-512, AVX2 (with FMA), SSE2, or the scalar loop.
+//  The kernels are compiled for their instruction set with target attributes, so no compiler flag is needed
+//  and the executables still run on processors without AVX. Other compilers and processors use the scalar loop.
+//  The environment variable KDTREE_SIMD (avx512, avx2, sse2 or scalar) restricts the choice, e.g. for testing.
+//  kernelName() tells which kernel is used.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef distanceKernels_hpp
+#define distanceKernels_hpp
+
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KDTREE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace distanceKernels{
+
+typedef float (*FloatKernel)(const float* a, const float* b, int n, float limit);
+
+const int checkEvery = 32; // dimensions between two checks of the partial sum
+
+// The scalar loop, for any type.
+template<typename T>
+inline T squaredScalar(const T* a, const T* b, int n, T limit){
+    T sum = 0;
+    int i = 0;
+    while (i < n){
+        int end = n - i > checkEvery ? i + checkEvery : n;
+        for (; i < end; i++){
+            T diff = a[i] - b[i];
+            sum += diff * diff;
+        }
+        if (sum > limit)
+            return sum;
+    }
+    return sum;
+}
+
+inline float squaredScalarFloat(const float* a, const float* b, int n, float limit){
+    return squaredScalar<float>(a, b, n, limit);
+}
+
+#ifdef KDTREE_X86_KERNELS
+
+__attribute__((target("sse2")))
+inline float horizontalSum(__m128 v){
+    __m128 high = _mm_movehl_ps(v, v);
+    v = _mm_add_ps(v, high);
+    high = _mm_shuffle_ps(v, v, 1);
+    return _mm_cvtss_f32(_mm_add_ss(v, high));
+}
+
+// 4 dimensions at a time
+__attribute__((target("sse2")))
+inline float squaredSSE2(const float* a, const float* b, int n, float limit){
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+        if ((i + 4) % checkEvery == 0 && i + 4 < n && horizontalSum(acc) > limit)
+            return horizontalSum(acc);
+    }
+    float sum = horizontalSum(acc);
+    for (; i < n; i++){
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float horizontalSum(__m256 v){
+    return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+// 8 dimensions at a time. Shorter points go to the SSE2 kernel.
+__attribute__((target("avx2,fma")))
+inline float squaredAVX2(const float* a, const float* b, int n, float limit){
+    if (n < 8)
+        return squaredSSE2(a, b, n, limit);
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_fmadd_ps(diff, diff, acc);
+        if ((i + 8) % checkEvery == 0 && i + 8 < n && horizontalSum(acc) > limit)
+            return horizontalSum(acc);
+    }
+    float sum = horizontalSum(acc);
+    for (; i + 4 <= n; i += 4){
+        __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum += horizontalSum(_mm_mul_ps(diff, diff));
+    }
+    for (; i < n; i++){
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// sum of the 16 lanes, through a stored array: GCC's 512-to-256 extracts (and _mm512_reduce_add_ps, built on them)
+// start from an undefined register and warn with -Wmaybe-uninitialized
+__attribute__((target("avx512f,avx2,fma")))
+inline float horizontalSum(__m512 v){
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    return horizontalSum(_mm256_add_ps(_mm256_load_ps(lanes), _mm256_load_ps(lanes + 8)));
+}
+
+// 16 dimensions at a time, the remainder with a mask. Shorter points go to the AVX2 kernel.
+__attribute__((target("avx512f,avx2,fma")))
+inline float squaredAVX512(const float* a, const float* b, int n, float limit){
+    if (n < 16)
+        return squaredAVX2(a, b, n, limit);
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16){
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+        if ((i + 16) % checkEvery == 0 && i + 16 < n){
+            float sum = horizontalSum(acc);
+            if (sum > limit)
+                return sum;
+        }
+    }
+    if (i < n){
+        __mmask16 mask = static_cast<__mmask16>((1u << (n - i)) - 1);
+        __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    return horizontalSum(acc);
+}
+
+#endif
+
+// Whether the kernel name is allowed by KDTREE_SIMD.
+// The variable names the widest kernel to use: e.g. avx2 allows avx2, sse2 and scalar.
+inline bool allowed(const char* name){
+    const char* order[] = {"scalar", "sse2", "avx2", "avx512"};
+    const char* limit = getenv("KDTREE_SIMD");
+    if (limit == nullptr)
+        return true;
+    int limitRank = -1, nameRank = 0;
+    for (int r = 0; r < 4; r++){
+        if (strcmp(limit, order[r]) == 0) limitRank = r;
+        if (strcmp(name, order[r]) == 0) nameRank = r;
+    }
+    return limitRank < 0 || nameRank <= limitRank;
+}
+
+// Picks the widest kernel the processor supports. Sets name to its name.
+inline FloatKernel selectKernel(const char** name){
+#ifdef KDTREE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && allowed("avx512")){
+        *name = "avx512";
+        return squaredAVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && allowed("avx2")){
+        *name = "avx2";
+        return squaredAVX2;
+    }
+    if (__builtin_cpu_supports("sse2") && allowed("sse2")){
+        *name = "sse2";
+        return squaredSSE2;
+    }
+#endif
+    *name = "scalar";
+    return squaredScalarFloat;
+}
+
+// The selected kernel, chosen at the first call (thread-safe in C++11).
+struct Dispatch{
+    const char* name;
+    FloatKernel kernel;
+    Dispatch(){ kernel = selectKernel(&name); }
+};
+
+inline const Dispatch & dispatch(){
+    static const Dispatch selected;
+    return selected;
+}
+
+// Name of the kernel used for float: avx512, avx2, sse2 or scalar.
+inline const char* kernelName(){
+    return dispatch().name;
+}
+
+// The squared distance between a[0..n-1] and b[0..n-1], or some value greater than limit
+// if it is greater than limit.
+template<typename T>
+inline T squared(const T* a, const T* b, int n, T limit = std::numeric_limits<T>::infinity()){
+    return squaredScalar<T>(a, b, n, limit);
+}
+
+template<>
+inline float squared<float>(const float* a, const float* b, int n, float limit){
+    return dispatch().kernel(a, b, n, limit);
+}
+
+// squared(a, b, n, limit) for points of D dimensions if D > 0, of n dimensions otherwise.
+template<int D, typename T>
+inline T squaredDim(const T* a, const T* b, int n, T limit = std::numeric_limits<T>::infinity()){
+    if (D <= 0 || D >= checkEvery)
+        return squared<T>(a, b, n, limit);
+    T sum = 0;
+    for (int i = 0; i < D; i++){
+        T diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+}
+
+#endif /* distanceKernels_hpp */
@@ -0,0 +1,176 @@
+//
+//  parallel.hpp
+//
+//  Helpers to run independent tasks on several threads.
+//
+//      - defaultThreads(): the number of hardware threads (at least 1).
+//      - forEach(numTasks, numThreads, f): calls f(task) for task = 0 ... numTasks-1.
+//        Each thread claims the next unclaimed task, so uneven tasks are balanced across threads.
+//        If tasks throw, the exception of the lowest task is rethrown once all threads have joined.
+//      - WorkerPool(numThreads): threads started once, shared by several callers (e.g. the connections of a server).
+//        run(numTasks, f) is forEach on the pool: it waits until its tasks are done, while the tasks of other callers
+//        are run by the same threads, so that the callers together never use more than numThreads threads.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel{
+
+// Number of hardware threads (at least 1).
+inline int defaultThreads(){
+    unsigned n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+// Calls f(task) for every task in [0, numTasks) on up to numThreads threads.
+// With one thread (or one task) everything runs on the calling thread.
+template<class F>
+void forEach(int numTasks, int numThreads, F f){
+
+    if (numThreads > numTasks)
+        numThreads = numTasks;
+    if (numThreads <= 1){
+        for (int task = 0; task < numTasks; task++)
+            f(task);
+        return;
+    }
+
+    std::atomic<int> next(0);
+    std::vector<std::exception_ptr> errors(numTasks);
+    auto worker = [&](){
+        for (int task = next++; task < numTasks; task = next++){
+            try{
+                f(task);
+            }
+            catch (...){
+                errors[task] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++)
+        threads.push_back(std::thread(worker));
+    worker(); // the calling thread works too
+    for (auto & th : threads)
+        th.join();
+
+    for (auto & e : errors){
+        if (e) std::rethrow_exception(e);
+    }
+}
+
+// A fixed set of threads running the tasks of several callers, in the order they were submitted.
+class WorkerPool{
+
+public:
+    explicit WorkerPool(int numThreads = defaultThreads());
+    ~WorkerPool(); // finishes the queued tasks, then stops the threads
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool & operator=(const WorkerPool &) = delete;
+
+    // Calls f(task) for every task in [0, numTasks) on the pool, and waits until all are done.
+    // If tasks throw, the exception of the lowest task is rethrown.
+    template<class F>
+    void run(int numTasks, F f);
+
+    int numThreads() const{ return static_cast<int>(threads.size()); }
+
+private:
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable wake; // a task was queued, or the pool stops
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+inline WorkerPool::WorkerPool(int numThreads){
+    for (int t = 0; t < (numThreads > 1 ? numThreads : 1); t++)
+        threads.push_back(std::thread(&WorkerPool::work, this));
+}
+
+inline WorkerPool::~WorkerPool(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto & th : threads)
+        th.join();
+}
+
+// Runs queued tasks until the pool stops and the queue is empty.
+inline void WorkerPool::work(){
+    while (true){
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this](){ return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+template<class F>
+void WorkerPool::run(int numTasks, F f){
+    if (numTasks <= 0)
+        return;
+
+    // the tasks of this call, which report to the waiting caller
+    struct Batch{
+        std::mutex mutex;
+        std::condition_variable done;
+        int remaining;
+        std::vector<std::exception_ptr> errors;
+    };
+    std::shared_ptr<Batch> batch(new Batch());
+    batch->remaining = numTasks;
+    batch->errors.resize(numTasks);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int task = 0; task < numTasks; task++){
+            tasks.push_back([batch, task, &f](){
+                try{
+                    f(task);
+                }
+                catch (...){
+                    batch->errors[task] = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                if (--batch->remaining == 0)
+                    batch->done.notify_one();
+            });
+        }
+    }
+    wake.notify_all();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done.wait(lock, [&](){ return batch->remaining == 0; });
+    for (auto & e : batch->errors){
+        if (e) std::rethrow_exception(e);
+    }
+}
+
+}
+
+#endif /* parallel_hpp */
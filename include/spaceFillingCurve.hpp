@@ -0,0 +1,73 @@
+//
+//  spaceFillingCurve.hpp
+//
+//  Orders points along a space-filling curve, so that points close in the order are close in space.
+//
+//  The Morton (Z-order) code of a point interleaves the bits of its coordinates:
+//      - every coordinate is quantized to bitsPerAxis bits within a bounding box (values outside are clamped),
+//      - the bits are taken from the most significant down, one axis after the other.
+//  The code is 64 bits: with d axes, every axis gets 64/d bits. Points of more than 64 dimensions are ordered
+//  by their first 64 axes, one bit each, which still groups them coarsely.
+//
+//  mortonOrder(...) sorts the rows of a table by their code. It is used by QueryTable to search neighbouring
+//  queries one after the other, so that they find the nodes and points of the tree still in the cache.
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef spaceFillingCurve_hpp
+#define spaceFillingCurve_hpp
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include "statHelper.hpp"
+#include "parallel.hpp"
+
+namespace spaceFillingCurve{
+
+// The Morton code of a point of dim values within box.
+template<typename T>
+uint64_t mortonCode(const T* point, int dim, const statHelper::AxisExtent<T> & box){
+    int axes = std::min(dim, 64);
+    int bitsPerAxis = 64 / axes;
+    uint64_t maxCell = (bitsPerAxis == 64) ? ~0ULL : (1ULL << bitsPerAxis) - 1;
+
+    uint64_t cells[64];
+    for (int axis=0; axis<axes; axis++){
+        T width = box.width(axis);
+        double t = width > 0 ? (static_cast<double>(point[axis]) - box.lower(axis)) / width : 0;
+        t = std::min(std::max(t, 0.0), 1.0);
+        cells[axis] = std::min(static_cast<uint64_t>(t * static_cast<double>(maxCell)), maxCell);
+    }
+    uint64_t code = 0;
+    for (int bit=bitsPerAxis-1; bit>=0; bit--){
+        for (int axis=0; axis<axes; axis++)
+            code = (code << 1) | ((cells[axis] >> bit) & 1);
+    }
+    return code;
+}
+
+// The rows of table sorted by their Morton code within box (equal codes by row). The codes are computed on numThreads.
+template<typename T, class Table>
+std::vector<int> mortonOrder(const Table & table, const statHelper::AxisExtent<T> & box, int numThreads = 1){
+    int n = table.size();
+    std::vector<std::pair<uint64_t, int>> codes(n);
+    int chunkSize = 4096;
+    parallel::forEach((n + chunkSize - 1) / chunkSize, numThreads, [&](int chunk){
+        int end = std::min(n, (chunk + 1) * chunkSize);
+        for (int i=chunk * chunkSize; i<end; i++)
+            codes[i] = std::make_pair(mortonCode<T>(table.row(i).data(), table.dim(), box), i);
+    });
+    std::sort(codes.begin(), codes.end());
+    std::vector<int> order(n);
+    for (int i=0; i<n; i++)
+        order[i] = codes[i].second;
+    return order;
+}
+
+}
+
+#endif /* spaceFillingCurve_hpp */
@@ -0,0 +1,148 @@
+//
+//  splitPolicies.hpp
+//
+//  The split policies tell KdTreeBuilder where to split a node: along which axis, and at which point.
+//  The policy is a template parameter of KdTreeBuilder (and of the KdTree constructor that builds with it),
+//  so the choice is made at compile time and costs nothing per node:
+//      - Statistic: the axis chosen by a statistic of the points (rule), split at the median.
+//            0: maximizing standard deviation, 1: minimizing skew, 2: minimizing kurtosis. The original split.
+//      - WidestExtent: the axis along which the bounding box of the points is the widest, split at the median.
+//      - SlidingMidpoint: the axis along which the bounding box is the widest, split at the middle of the box.
+//            The cells stay close to cubes, even where the points are clustered. The node is the point nearest
+//            below the middle (the split slides to the points), so every node keeps at least its own point.
+//            A side may still hold no point, e.g. the left one when the node is the lowest point: it gets no child.
+//
+//  A policy has:
+//      - name(): its name, as given to build_kdtree --split,
+//      - choose(builder, begin, end, inParallel): the Split of the points of the range [begin, end) of the builder.
+//        The statistics of the points are gathered by builder.accumulate(...), which reads every point once
+//        (or a sample of them) and spreads large nodes over the threads. See KdTreeBuilder.hpp.
+//
+//  New policies can be written the same way, with an accumulator of statHelper.hpp or their own
+//  (with reset(dim), add(point) and merge(other)).
+//
+//
+//  Copyright © 2016 Serim Park . All rights reserved.
+//
+
+#ifndef splitPolicies_hpp
+#define splitPolicies_hpp
+
+#include <cmath>
+#include <limits>
+#include "statHelper.hpp"
+
+namespace splitPolicy{
+
+// Where a node is split: along axis, at the median point if atMedian,
+// otherwise at the point of the largest value not greater than value.
+template<typename T>
+struct Split{
+    int axis;
+    bool atMedian;
+    T value;
+};
+
+// The axis with the largest criterion(axis). The first axis wins a tie.
+template<class Criterion>
+int bestAxis(int dim, Criterion criterion){
+    double maxVal = -std::numeric_limits<double>::infinity();
+    int splitAxis = 0;
+    for(int axis=0; axis<dim; axis++){
+        double value = criterion(axis);
+        if (value > maxVal) {
+            maxVal = value;
+            splitAxis = axis;
+        }
+    }
+    return splitAxis;
+}
+
+// The axis chosen by a statistic of the points, split at the median.
+// Only the moments the rule needs are computed.
+struct Statistic{
+
+    int rule; // 0: maximizing standard deviation, 1: minimizing skew, 2: minimizing kurtosis
+
+    Statistic(int rule = 0): rule(rule){}
+    const char* name() const { return "statistic"; }
+
+    template<typename T, class Builder>
+    Split<T> choose(const Builder & builder, int begin, int end, bool inParallel) const{
+        switch (statHelper::orderOfRule(rule)){
+            case 3:
+                return chooseBy<T, 3>(builder, begin, end, inParallel);
+            case 4:
+                return chooseBy<T, 4>(builder, begin, end, inParallel);
+            default:
+                return chooseBy<T, 2>(builder, begin, end, inParallel);
+        }
+    }
+
+private:
+
+    // The moments up to order of every axis, in one pass over the points.
+    template<typename T, int order, class Builder>
+    Split<T> chooseBy(const Builder & builder, int begin, int end, bool inParallel) const{
+        static thread_local statHelper::AxisMoments<T, order> moments; // reused from one node to the next
+        builder.accumulate(begin, end, inParallel, moments);
+        Split<T> split;
+        split.axis = bestAxis(moments.dim(), [&](int axis){ return criterion(moments, axis); });
+        split.atMedian = true;
+        split.value = 0;
+        return split;
+    }
+
+    // The criterion of an axis under the rule: the larger, the better the axis.
+    // A constant axis is never preferred for skew or kurtosis, which are undefined on it.
+    template<typename T, int order>
+    double criterion(const statHelper::AxisMoments<T, order> & moments, int axis) const{
+        if (rule == 0 || order == 2) // use only std
+            return moments.stdDev(axis);
+        if (moments.stdDev(axis) == 0)
+            return -std::numeric_limits<double>::infinity();
+        if (rule == 1) // use skew
+            return - std::abs(moments.skew(axis));
+        return - std::abs(moments.kurtosis(axis)); // use kurtosis
+    }
+};
+
+// The axis along which the bounding box of the points is the widest, split at the median.
+struct WidestExtent{
+
+    const char* name() const { return "widest"; }
+
+    template<typename T, class Builder>
+    Split<T> choose(const Builder & builder, int begin, int end, bool inParallel) const{
+        static thread_local statHelper::AxisExtent<T> box;
+        builder.accumulate(begin, end, inParallel, box);
+        Split<T> split;
+        split.axis = bestAxis(box.dim(), [&](int axis){ return static_cast<double>(box.width(axis)); });
+        split.atMedian = true;
+        split.value = 0;
+        return split;
+    }
+};
+
+// The axis along which the bounding box of the points is the widest, split at the middle of the box.
+// The node is the point of the largest value not greater than the middle: as the smallest value is,
+// the left side always has the node, and the split slides to the nearest point below the middle.
+struct SlidingMidpoint{
+
+    const char* name() const { return "midpoint"; }
+
+    template<typename T, class Builder>
+    Split<T> choose(const Builder & builder, int begin, int end, bool inParallel) const{
+        static thread_local statHelper::AxisExtent<T> box;
+        builder.accumulate(begin, end, inParallel, box);
+        Split<T> split;
+        split.axis = bestAxis(box.dim(), [&](int axis){ return static_cast<double>(box.width(axis)); });
+        split.atMedian = false;
+        split.value = box.lower(split.axis) + box.width(split.axis) / 2;
+        return split;
+    }
+};
+
+}
+
+#endif /* splitPolicies_hpp */
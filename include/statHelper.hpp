@@ -1,8 +1,20 @@
 //
 //  statHelper.hpp
 //
-//  Implementation for functions that return statistics of a vector,
-//  such as median, mean, variance, skew, and kurtosis.
+//  Statistics of the columns of a set of points, used to choose the splitting axis:
+//  standard deviation, skew, kurtosis, and the bounding box.
+//
+//  AxisMoments accumulates the central moments of every axis in a single pass over the points,
+//  each point being read once, as a row. Only the moments the rule needs are kept (order):
+//      - 2: the standard deviation (maximizing variance)
+//      - 3: and the skew
+//      - 4: and the kurtosis
+//  The moments are updated one point at a time (Welford's update, extended by Terriberry to the 3rd and 4th moments),
+//  which is accurate without a second pass over the points. Two sets of moments can be merged (Chan et al.),
+//  so that the moments of a large set can be accumulated by chunks on several threads.
+//
+//  AxisExtent accumulates the bounding box of the points (the smallest and largest value of every axis)
+//  the same way.
 //
 //
 //  Copyright © 2016 Serim Park . All rights reserved.
@@ -12,7 +24,7 @@
 #define statHelper_h
 
 #include <cmath>
-#include <deque>
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <string>
@@ -21,81 +33,176 @@
 using std::string;
 using std::to_string;
 using std::vector;
-using std::deque;
 
 namespace statHelper{
-    
-// Finds median.
-template<typename T, class CSVTable>
-T findMedian(const CSVTable* trainData, int axis, const vector <int> & ind){
-    
-    deque<T> col = trainData->get(ind, axis);
-    int n;
-    if (col.size()%2 == 0)
-        n = static_cast<int>(col.size()/2);
-    else
-        n = static_cast<int>((col.size()-1)/2);
-    std::nth_element(col.begin(), col.begin() + n, col.end());
-    return col[n];
-    
-}
 
-// Finds the indices of the vector which is the median.
-template<typename T, class CSVTable>
-int findMedianPos(const CSVTable* trainData, int axis, const vector <int> & ind, T median){
-    
-    deque<T> col = trainData->get(ind, axis);
-    auto iterator = std::find(col.begin(), col.end(), median);
-    int medianInd = static_cast<int>(iterator - col.begin());
-    return medianInd;
+// The highest moment needed by a rule: 2 for the standard deviation (0), 3 for skew (1), 4 for kurtosis (2).
+inline int orderOfRule(int rule){
+    return rule == 1 ? 3 : (rule == 2 ? 4 : 2);
 }
 
+template<typename T, int order>
+class AxisMoments{
+
+public:
+
+    AxisMoments(int dim = 0){ reset(dim); }
+
+    void reset(int dim); // empties the moments of dim axes
+    void add(const T* point); // adds a point (its dim values)
+    void merge(const AxisMoments & other); // adds the points of other
+
+    int dim() const { return static_cast<int>(mean.size()); }
+    double count() const { return n; }
+    double stdDev(int axis) const; // population standard deviation
+    double skew(int axis) const; // Fisher-Pearson coefficient of skewness. Should be approx 0 when normally distributed.
+    double kurtosis(int axis) const; // Small Kurtosis = light tail and heavy peak.
+    // skew and kurtosis are 0 if their moment is not kept, or if the axis is constant
+
+private:
 
-// Finds mean.
-template<typename T, class CSVTable>
-T findMean(const CSVTable* trainData, int axis, const vector <int> & ind){
-    T mean = 0;
-    for(int i=0; i<ind.size(); i++){
-        mean += trainData->get(i,axis);
+    double n = 0; // number of points
+    vector<double> mean;
+    vector<double> m2; // sums of the powers of the deviations from the mean
+    vector<double> m3;
+    vector<double> m4;
+};
+
+// empties the moments of dim axes
+template<typename T, int order>
+void AxisMoments<T, order>::reset(int dim){
+    n = 0;
+    mean.assign(dim, 0);
+    m2.assign(dim, 0);
+    m3.assign(order >= 3 ? dim : 0, 0);
+    m4.assign(order >= 4 ? dim : 0, 0);
+}
+
+// adds a point: updates the moments of every axis
+template<typename T, int order>
+void AxisMoments<T, order>::add(const T* point){
+    double n1 = n;
+    n += 1;
+    double invN = 1 / n;
+    double c4 = n * n - 3 * n + 3;
+    for (int axis = 0; axis < dim(); axis++){
+        double delta = point[axis] - mean[axis];
+        double deltaN = delta * invN;
+        double term = delta * deltaN * n1;
+        mean[axis] += deltaN;
+        if (order >= 4)
+            m4[axis] += term * deltaN * deltaN * c4 + 6 * deltaN * deltaN * m2[axis] - 4 * deltaN * m3[axis];
+        if (order >= 3)
+            m3[axis] += term * deltaN * (n - 2) - 3 * deltaN * m2[axis];
+        m2[axis] += term;
     }
-    return mean / ind.size();
-    
 }
 
-// Finds standard deviation.
-template<typename T, class CSVTable>
-T findStd(const CSVTable* trainData, int axis, const vector <int> & ind, T mean){
-    T std = 0;
-    for(int i=0; i<ind.size(); i++){
-        std += pow(trainData->get(i,axis) - mean,2);
+// adds the points of other
+template<typename T, int order>
+void AxisMoments<T, order>::merge(const AxisMoments & other){
+    if (other.n == 0)
+        return;
+    if (n == 0){
+        *this = other;
+        return;
+    }
+    double na = n, nb = other.n, total = n + other.n;
+    for (int axis = 0; axis < dim(); axis++){
+        double delta = other.mean[axis] - mean[axis];
+        double delta2 = delta * delta;
+        if (order >= 4)
+            m4[axis] += other.m4[axis] + delta2 * delta2 * na * nb * (na * na - na * nb + nb * nb) / (total * total * total)
+                + 6 * delta2 * (na * na * other.m2[axis] + nb * nb * m2[axis]) / (total * total)
+                + 4 * delta * (na * other.m3[axis] - nb * m3[axis]) / total;
+        if (order >= 3)
+            m3[axis] += other.m3[axis] + delta2 * delta * na * nb * (na - nb) / (total * total)
+                + 3 * delta * (na * other.m2[axis] - nb * m2[axis]) / total;
+        m2[axis] += other.m2[axis] + delta2 * na * nb / total;
+        mean[axis] += delta * nb / total;
     }
-    return sqrt(std/ind.size());
+    n = total;
 }
 
-// Sample Fisher-Pearson coefficient of skewness. Should be approx 0 when normally distributed.
-template<typename T, class CSVTable>
-T findSkew(const CSVTable* trainData, int axis, const vector <int> & ind, T mean, T std){
-    
-    T skew = 0;
-    int N = static_cast<int>(ind.size());
-    for(int i=0; i<N; i++){
-        skew += pow(trainData->get(i,axis) - mean,3);
+// population standard deviation
+template<typename T, int order>
+double AxisMoments<T, order>::stdDev(int axis) const{
+    return n > 0 ? std::sqrt(m2[axis] / n) : 0;
+}
+
+// Sample Fisher-Pearson coefficient of skewness.
+template<typename T, int order>
+double AxisMoments<T, order>::skew(int axis) const{
+    double s = stdDev(axis);
+    return order >= 3 && s > 0 ? m3[axis] / n / (s * s * s) : 0;
+}
+
+// Sample Kurtosis.
+template<typename T, int order>
+double AxisMoments<T, order>::kurtosis(int axis) const{
+    double s = stdDev(axis);
+    return order >= 4 && s > 0 ? m4[axis] / n / (s * s * s * s) : 0;
+}
+
+template<typename T>
+class AxisExtent{
+
+public:
+
+    AxisExtent(int dim = 0){ reset(dim); }
+
+    void reset(int dim); // empties the box of dim axes
+    void add(const T* point); // adds a point (its dim values)
+    void merge(const AxisExtent & other); // adds the points of other
+
+    int dim() const { return static_cast<int>(low.size()); }
+    T lower(int axis) const { return low[axis]; } // the smallest value along axis
+    T upper(int axis) const { return high[axis]; } // the largest value along axis
+    T width(int axis) const { return high[axis] - low[axis]; } // 0 for a constant axis or no points
+
+private:
+
+    bool empty = true;
+    vector<T> low;
+    vector<T> high;
+};
+
+// empties the box of dim axes
+template<typename T>
+void AxisExtent<T>::reset(int dim){
+    empty = true;
+    low.assign(dim, 0);
+    high.assign(dim, 0);
+}
+
+// adds a point: widens the box to hold it
+template<typename T>
+void AxisExtent<T>::add(const T* point){
+    if (empty){
+        low.assign(point, point + dim());
+        high.assign(point, point + dim());
+        empty = false;
+        return;
+    }
+    for (int axis = 0; axis < dim(); axis++){
+        low[axis] = std::min(low[axis], point[axis]);
+        high[axis] = std::max(high[axis], point[axis]);
     }
-    
-    return skew/pow(std,3);
 }
 
-// Sample Kurtosis. Small Kurtosis = light tail and heavy peak.
-template<typename T, class CSVTable>
-T findKurtosis(const CSVTable* trainData, int axis, const vector <int> & ind, T mean, T std){
-    
-    T kurt = 0;
-    int N = static_cast<int>(ind.size());
-    for(int i=0; i<N; i++){
-        kurt += pow(trainData->get(i,axis) - mean,4);
+// adds the points of other
+template<typename T>
+void AxisExtent<T>::merge(const AxisExtent & other){
+    if (other.empty)
+        return;
+    if (empty){
+        *this = other;
+        return;
+    }
+    for (int axis = 0; axis < dim(); axis++){
+        low[axis] = std::min(low[axis], other.low[axis]);
+        high[axis] = std::max(high[axis], other.high[axis]);
     }
-    
-    return kurt/pow(std,4);
 }
 
 }
@@ -0,0 +1,119 @@
+//  This is the main function for query_client
+//
+//  This function sends the query data to a running query_server and saves the results, as query_kdtree does.
+//  It gets three arguments from the console:
+//      (1) The path of the server's socket
+//      (2) The absolute path to the query data (.csv or binary)
+//      (3) The absolute path to the knn search result to be saved (.csv)
+//
+//  Options (after the three arguments):
+//      -k N        finds the N nearest points of every query (with --radius, at most the N nearest).
+//      --radius R  finds all the points within distance R of every query.
+//      --batch N   sends the queries in requests of N queries (default: 4096).
+//
+//  Alternatively, "query_client socket --reload model train" makes the server load a new model
+//  (train being '-' if the model embeds the points).
+//
+//  Copyright © 2016 Serim. All rights reserved.
+//
+//
+#include "QueryClient.hpp"
+#include "CSVTable.hpp"
+#include "parallel.hpp"
+#include <fstream>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+using std::cout;
+using std::endl;
+
+int main(int argc, const char * argv[]) {
+
+    if (argc == 5 && strcmp(argv[2], "--reload") == 0){
+        try{
+            QueryClient client(argv[1]);
+            client.reload(argv[3], argv[4]);
+        }
+        catch (const std::exception & e){
+            std::cerr << "... " << e.what() << " ..." << endl; // the server's message, or the failed connection
+            return 1;
+        }
+        cout << "... Reloaded ... " << endl;
+        return 0;
+    }
+    if (argc < 4){
+        cout<< "---------------- Arguments are missing  --------------------" <<endl;
+        cout<< "Please provide 3 arguments: "<<endl;
+        cout<< "(1) The path of the server's socket." <<endl;
+        cout<< "(2) The absolute path of the query data."<<endl;
+        cout<< "(3) The absolute path to save the query result."<<endl;
+        cout<< "or: socket --reload model train" <<endl;
+        return 1;
+    }
+    const char* socketPath = argv[1];
+    const char* testFileName = argv[2];
+    const char* queryResultFileName = argv[3];
+    int k = 1;
+    bool hasK = false;
+    float radius = -1;
+    int batchSize = 4096;
+    for (int i=4; i<argc; i++){
+        if (strcmp(argv[i], "-k") == 0 && i+1 < argc && atoi(argv[i+1]) > 0){
+            k = atoi(argv[++i]);
+            hasK = true;
+        }
+        else if (strcmp(argv[i], "--radius") == 0 && i+1 < argc && atof(argv[i+1]) >= 0)
+            radius = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+            batchSize = atoi(argv[++i]);
+        else{
+            cout<< "Unknown option: " << argv[i] <<endl;
+            return 1;
+        }
+    }
+
+    cout<<"------------------------------------------------------------"<<endl;
+    try{
+        cout<<"... Loading the test data ..."<< endl;
+        CSVTable <float> testTable(testFileName, parallel::defaultThreads());
+        cout<<"... Querying " << socketPath << " ..."<< endl;
+        QueryClient client(socketPath);
+
+        std::ofstream fout(queryResultFileName, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+        if (!fout.is_open())
+            throw std::runtime_error("Couldn't open CSV file to write.");
+        std::vector<int32_t> counts, indices;
+        std::vector<float> distances;
+        for (int begin=0; begin<testTable.size(); begin+=batchSize){
+            int n = std::min(batchSize, testTable.size() - begin);
+            const float* queries = testTable.data() + static_cast<size_t>(begin) * testTable.dim();
+            if (radius >= 0)
+                client.radiusSearch(queries, n, testTable.dim(), radius, hasK ? k : 0, counts, indices, distances);
+            else
+                client.knnSearch(queries, n, testTable.dim(), k, counts, indices, distances);
+            // one row per query: indice1,distance1,indice2,distance2,...
+            size_t slot = 0;
+            for (int i=0; i<n; i++){
+                for (int j=0; j<counts[i]; j++, slot++){
+                    fout<< indices[slot] << "," << distances[slot];
+                    if (j < counts[i]-1) fout<<",";
+                }
+                fout<<"\n";
+            }
+        }
+        fout.close();
+    }
+    catch (const std::exception & e){
+        // e.g. the server's message: queries of the wrong dimension, no model loaded
+        std::cerr << "... " << e.what() << " ..." << endl;
+        return 1;
+    }
+
+    cout << "... Done ... " << endl;
+    return 0;
+}
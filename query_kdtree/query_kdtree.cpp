@@ -2,10 +2,34 @@
 //
 //  This function gets two arguments from the console:
 //      (1) The absolute path to the train data (.csv)
-//      (2) The absolute path to the kdtree model (.csv)
+//      (2) The absolute path to the kdtree model (.csv or binary)
 //      (3) The absolute path to the test data (.csv)
 //      (4) The absolute path to the knn search result to be saved (.csv)
 //
+//  Options (after the four arguments):
+//      -k N        finds the N nearest points of every query, written nearest first as
+//                  indice1,distance1,...,indiceN,distanceN. By default only the nearest point is searched.
+//      -t N        searches the queries on N threads (default: all the hardware threads).
+//      --bound B   approximate search: looks across a splitting hyperplane only if it is closer than B
+//                  (and always at the root). By default the search is exact.
+//      --epsilon E (1+E)-approximate search: crosses a splitting hyperplane only if it is closer than
+//                  the k-th distance so far divided by 1+E. The points found are at most 1+E times farther
+//                  than the true neighbours.
+//      --max-checks N  stops a query once N points are compared to it and it holds its k nearest so far.
+//      --ground-truth F  reports the recall against the true neighbours in F (e.g. examples/more_examples/ground_truth).
+//      --reorder   searches the queries in the order of a space-filling curve (Morton order), so that consecutive
+//                  queries reuse the nodes in the cache. The results are the same, in the order of the queries.
+//      --dual-tree builds a tree over the queries and searches all of them at once, traversing both trees together.
+//                  Much faster when there are about as many queries as train points. Exact, or with --epsilon.
+//      --radius R  radius search: finds all the points within distance R of every query, written nearest first as
+//                  indice1,distance1,indice2,distance2,... (an empty line if none). With -k N, at most the N nearest.
+//      --stream    keeps the tree loaded and answers the queries as they come: every line read from the test data
+//                  (which can be '-' for the standard input, or a named pipe) is answered at once by a line of the
+//                  result ('-' for the standard output). The messages then go to the standard error.
+//
+//  If the model embeds the points (build_kdtree --embed-points), the train data is not needed
+//  and '-' can be given as its path.
+//
 //  Alternatively, by typing '1' at the prompt,
 //  sample_data.csv, precomputed_model.csv, query_data.csv can be loaded and saved as query_result.csv
 //
@@ -17,12 +41,17 @@
 #include "KdNode.hpp"
 #include "CSVTable.hpp"
 #include "QueryTable.hpp"
+#include "RadiusQueryTable.hpp"
+#include "QueryStream.hpp"
+#include "parallel.hpp"
 #include <fstream>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <memory>
+#include <cstring>
+#include <cstdlib>
 
 using std::vector;
 using std::cout;
@@ -30,13 +59,172 @@ using std::endl;
 using std::cin;
 
 
-int main(int argc, const char * argv[]) {
-    
+// the arguments and options of the command line
+struct Options{
     const char* fileName;
     const char* modelFileName;
     const char* testFileName;
     const char* queryResultFileName;
+    int k = 1;
+    bool hasK = false;
+    float radius = -1; // k-nearest search unless given
+    float bound = -1; // exact search unless given
+    float epsilon = 0;
+    int maxChecks = 0;
+    const char* groundTruthFileName = nullptr;
+    bool reorder = false;
+    bool dualTree = false;
+    bool stream = false;
+    int queryLeafSize = 16; // leaf size of the tree over the queries (--dual-tree)
+    int numThreads = parallel::defaultThreads();
+};
+
+// Loads the tree and searches the queries, or answers them as they come (--stream).
+// D is the dimension of the points, fixed at compile time so that the distances are unrolled, or 0 (any dimension).
+// The values of trainTable (and of testTable for --dual-tree) are moved to tables of that dimension.
+template<int D>
+int searchQueries(const Options & options, CSVTable<float> & trainTable, CSVTable<float> & testTable, std::ostream & info){
+    
+    bool hasTrainData = std::string(options.fileName) != "-";
+    
+    // Load The Tree
+    info<<"------------------------------------------------------------"<<endl;
+    info<<"... Loading the tree ..."<< endl;
+    typedef KdTree<float, CSVTable<float, D>> Tree;
+    Tree newTree;
+    {
+        CSVTable <float, D> trainPoints(std::move(trainTable)); // the values are moved, not copied
+        newTree.load(options.modelFileName, hasTrainData ? &trainPoints : nullptr);
+    } // the tree has gathered its own copy of the points: the train data (or its mapping) is freed here
+    if (!options.stream && testTable.size() > 0 && testTable.dim() != newTree.getPoints().dim()){
+        info<< "The queries have " << testTable.dim() << " values, the points of the tree " << newTree.getPoints().dim() <<endl;
+        return 1;
+    }
+    if (options.bound > 0){
+        info<<"... Approximate search with the bound " << options.bound << " ..."<< endl;
+        newTree.setBound(options.bound);
+        newTree.setSearchMode(Tree::boundedSearch);
+    }
+    if (options.epsilon > 0){
+        info<<"... (1+" << options.epsilon << ")-approximate search ..."<< endl;
+        newTree.setEpsilon(options.epsilon);
+    }
+    if (options.maxChecks > 0){
+        info<<"... At most " << options.maxChecks << " points checked per query ..."<< endl;
+        newTree.setMaxChecks(options.maxChecks);
+    }
+    
+    // Answer the queries as they come, until the input ends
+    if (options.stream){
+        info<<"------------------------------------------------------------"<<endl;
+        info<<"... Answering the queries as they come ..."<<endl;
+        std::ifstream fin;
+        std::ofstream fout;
+        bool fromStdin = std::string(options.testFileName) == "-";
+        bool toStdout = std::string(options.queryResultFileName) == "-";
+        if (!fromStdin){
+            fin.open(options.testFileName);
+            if (!fin.is_open())
+                throw std::runtime_error("Couldn't open the query data.");
+        }
+        if (!toStdout){
+            fout.open(options.queryResultFileName, std::fstream::out | std::fstream::binary);
+            if (!fout.is_open())
+                throw std::runtime_error("Couldn't open CSV file to write.");
+        }
+        QueryStream<float, CSVTable<float, D>> queryStream(newTree, options.k, options.radius, options.hasK);
+        long answered = queryStream.run(fromStdin ? cin : fin, toStdout ? cout : fout, std::cerr);
+        info<<"... " << answered << " queries answered ..."<<endl;
+        info <<"... Done. ... "<<endl;
+        return 0;
+    }
+    
+    // Knnsearch, or radius search
+    info<<"------------------------------------------------------------"<<endl;
+    if (options.radius >= 0 && options.hasK)
+        info<<"... Querying for the " << options.k << " closest points within " << options.radius << " ...."<<endl;
+    else if (options.radius >= 0)
+        info<<"... Querying for the points within " << options.radius << " ...."<<endl;
+    else if (options.k > 1)
+        info<<"... Querying for the " << options.k << " closest points ...."<<endl;
+    else
+        info<<"... Querying for the closest points ...."<<endl;
+    if (D > 0 && D < distanceKernels::checkEvery)
+        info<<"... Distance kernel: unrolled for " << D << " dimensions ..."<<endl;
+    else
+        info<<"... Distance kernel: " << distanceKernels::kernelName() << " ..."<<endl;
+    info<<"... Searching on " << options.numThreads << " thread(s) ..."<<endl;
+    std::unique_ptr<QueryTable<float>> queryTable;
+    std::unique_ptr<RadiusQueryTable<float>> radiusTable;
+    if (options.radius >= 0){
+        radiusTable.reset(new RadiusQueryTable<float>(testTable, newTree, options.radius, options.hasK ? options.k : 0, options.numThreads));
+        info<<"... " << radiusTable->numFound() << " points found ..."<<endl;
+    }
+    else if (options.dualTree){
+        info<<"... Building the tree of the queries ..."<<endl;
+        std::unique_ptr<Tree> testTree;
+        {
+            CSVTable <float, D> testPoints(std::move(testTable));
+            testTree.reset(new Tree(&testPoints, 0.1f, 0, options.queryLeafSize, options.numThreads));
+        } // likewise, the tree holds its own copy of the queries
+        info<<"... Dual-tree search ..."<<endl;
+        queryTable.reset(new QueryTable<float>(*testTree, newTree, options.k, options.numThreads));
+    }
+    else{
+        if (options.reorder) info<<"... The queries are searched in Morton order ..."<<endl;
+        queryTable.reset(new QueryTable<float>(testTable, newTree, options.k, options.numThreads, options.reorder));
+    }
+    if (queryTable){
+        info<<"... " << queryTable->nodesPerQuery() << (options.dualTree ? " pairs of nodes" : " nodes") << " visited per query ..."<<endl;
+        if (options.groundTruthFileName){
+            CSVTable <float> groundTruth(options.groundTruthFileName);
+            info<<"... Recall against " << options.groundTruthFileName << ": " << queryTable->recall(groundTruth) << " ..."<<endl;
+        }
+    }
+    
+    // Saving the result
+    info<<"------------------------------------------------------------"<<endl;
+    info<<"... Saving the query results ..."<<endl;
+    std::ofstream fout;
+
+    fout.open(options.queryResultFileName, std::fstream::out |  std::fstream::binary);
+    fout.close();
+    fout.open(options.queryResultFileName, std::fstream::out | std::fstream::app | std::fstream::binary);
+    if (fout.is_open()){
+        if (radiusTable)
+            radiusTable->write2CSV(fout);
+        else
+            queryTable->write2CSV(fout);
+    }
+    else{
+        throw std::runtime_error("Couldn't open CSV file to write.");
+    }
+    fout.close();
     
+    info<<"... Done. ... "<<endl;
+    return 0;
+}
+
+
+int main(int argc, const char * argv[]) {
+    
+    Options options;
+    
+    for (int i=1; i<argc; i++)
+        options.stream = options.stream || strcmp(argv[i], "--stream") == 0;
+    if (options.stream){
+        std::ios::sync_with_stdio(false); // lets cin buffer, so that a burst of queries is answered in one flush
+        cin.tie(nullptr);
+    }
+    // the results can go to the standard output when streaming, so the messages go to the standard error
+    std::ostream info(options.stream ? std::cerr.rdbuf() : cout.rdbuf());
+
+    if (argc < 5 && options.stream){
+        // nobody is there to answer the prompt
+        std::cerr<< "--stream needs the 4 arguments: train data, kdtree model, query data ('-' for the standard input) "
+                    "and query result ('-' for the standard output)." <<endl;
+        return 1;
+    }
     if (argc < 5){
         
         cout<< "---------------- Arguments are missing  --------------------" <<endl;
@@ -56,71 +244,85 @@ int main(int argc, const char * argv[]) {
             cout<< "The kdtree model is loaded from: ../../examples/precomputed_model.csv"<<endl;
             cout<< "The query data is loaded from: ../../examples/query_data.csv"<<endl;
             cout<< "The query result will be saved at: ../../examples/query_result.csv"<<endl;
-            fileName = "../../examples/sample_data.csv";
-            modelFileName = "../../examples/precomputed_model.csv";
-            testFileName = "../../examples/query_data.csv";
-            queryResultFileName = "../../examples/query_result.csv";
+            options.fileName = "../../examples/sample_data.csv";
+            options.modelFileName = "../../examples/precomputed_model.csv";
+            options.testFileName = "../../examples/query_data.csv";
+            options.queryResultFileName = "../../examples/query_result.csv";
         }
         else{
             return 1;
         }
     }
     
-    else if(argc == 5){
-        fileName = argv[1];
-        modelFileName = argv[2];
-        testFileName = argv[3];
-        queryResultFileName = argv[4];
-        cout<<"------------------------------------------------------------"<<endl;
-        cout<< "The train data is loaded from: " << fileName << endl;
-        cout<< "The kdtree model is loaded from: "<< modelFileName << endl;
-        cout<< "The query data is loaded from: " << testFileName <<endl;
-        cout<< "The query result will be saved at:" <<queryResultFileName<<endl;
+    else{
+        options.fileName = argv[1];
+        options.modelFileName = argv[2];
+        options.testFileName = argv[3];
+        options.queryResultFileName = argv[4];
+        for (int i=5; i<argc; i++){
+            if (strcmp(argv[i], "-k") == 0 && i+1 < argc && atoi(argv[i+1]) > 0){
+                options.k = atoi(argv[++i]);
+                options.hasK = true;
+            }
+            else if (strcmp(argv[i], "-t") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                options.numThreads = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--bound") == 0 && i+1 < argc && atof(argv[i+1]) > 0)
+                options.bound = static_cast<float>(atof(argv[++i]));
+            else if (strcmp(argv[i], "--epsilon") == 0 && i+1 < argc && atof(argv[i+1]) >= 0)
+                options.epsilon = static_cast<float>(atof(argv[++i]));
+            else if (strcmp(argv[i], "--max-checks") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+                options.maxChecks = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--ground-truth") == 0 && i+1 < argc)
+                options.groundTruthFileName = argv[++i];
+            else if (strcmp(argv[i], "--reorder") == 0)
+                options.reorder = true;
+            else if (strcmp(argv[i], "--dual-tree") == 0)
+                options.dualTree = true;
+            else if (strcmp(argv[i], "--stream") == 0)
+                continue; // see above
+            else if (strcmp(argv[i], "--radius") == 0 && i+1 < argc && atof(argv[i+1]) >= 0)
+                options.radius = static_cast<float>(atof(argv[++i]));
+            else{
+                info<< "Unknown option: " << argv[i] <<endl;
+                return 1;
+            }
+        }
+        if (options.stream && (options.dualTree || options.reorder || options.groundTruthFileName)){
+            info<< "--stream does not combine with --dual-tree, --reorder or --ground-truth" <<endl;
+            return 1;
+        }
+        info<<"------------------------------------------------------------"<<endl;
+        info<< "The train data is loaded from: " << options.fileName << endl;
+        info<< "The kdtree model is loaded from: "<< options.modelFileName << endl;
+        info<< "The query data is loaded from: " << options.testFileName <<endl;
+        info<< "The query result will be saved at:" <<options.queryResultFileName<<endl;
+        if (options.dualTree && (options.radius >= 0 || options.bound > 0 || options.maxChecks > 0)){
+            info<< "--dual-tree does not combine with --radius, --bound or --max-checks" <<endl;
+            return 1;
+        }
     }
     
     // Load Train and Test data
-    cout<<"------------------------------------------------------------"<<endl;
-    cout<<"... Loading the train data ..."<< endl;
-    CSVTable <float> trainTable(fileName);
-    cout<<"... Loading the test data ..."<< endl;
-    CSVTable <float> testTable(testFileName);
-    
-    // Load The Tree
-    cout<<"------------------------------------------------------------"<<endl;
-    cout<<"... Loading the tree ..."<< endl;
-    KdTree <float, CSVTable<float>> newTree;
-    std::ifstream fin;
-    fin.open(modelFileName, std::fstream::in | std::fstream::binary);
-    if (fin.is_open()){
-        newTree.loadCSV(newTree.getRoot(), fin);
+    info<<"------------------------------------------------------------"<<endl;
+    CSVTable <float> trainTable;
+    bool hasTrainData = std::string(options.fileName) != "-";
+    if (hasTrainData){
+        info<<"... Loading the train data ..."<< endl;
+        trainTable.load(options.fileName, parallel::defaultThreads());
     }
-    else{
-        throw std::runtime_error("Couldn't open CSV file to load.");
+    CSVTable <float> testTable;
+    if (!options.stream){
+        info<<"... Loading the test data ..."<< endl;
+        testTable.load(options.testFileName, parallel::defaultThreads());
     }
-    fin.close();
-    
     
-    // Knnsearch
-    cout<<"------------------------------------------------------------"<<endl;
-    cout<<"... Querying for the closest points ...."<<endl;
-    QueryTable <float> queryTable(testTable, newTree, &trainTable);
-    
-    // Saving the result
-    cout<<"------------------------------------------------------------"<<endl;
-    cout<<"... Saving the query results ..."<<endl;
-    std::ofstream fout;
-
-    fout.open(queryResultFileName, std::fstream::out |  std::fstream::binary);
-    fout.close();
-    fout.open(queryResultFileName, std::fstream::out | std::fstream::app | std::fstream::binary);
-    if (fout.is_open()){
-        queryTable.write2CSV(fout);
-    }
-    else{
-        throw std::runtime_error("Couldn't open CSV file to write.");
+    // The dimensions of the main datasets get their own, unrolled, instantiation; the others the generic one
+    int dim = hasTrainData ? trainTable.dim() : (options.stream ? 0 : testTable.dim());
+    switch (dim){
+        case 2: return searchQueries<2>(options, trainTable, testTable, info);
+        case 3: return searchQueries<3>(options, trainTable, testTable, info);
+        case 4: return searchQueries<4>(options, trainTable, testTable, info);
+        case 8: return searchQueries<8>(options, trainTable, testTable, info);
+        default: return searchQueries<0>(options, trainTable, testTable, info);
     }
-    fout.close();
-    
-    cout <<"... Done. ... "<<endl;
-    return 0;
 }
@@ -0,0 +1,104 @@
+//  This is the main function for query_server
+//
+//  This function keeps one kdtree loaded and answers the nearest-neighbour queries of local clients
+//  (query_client, or any program using QueryClient.hpp) over a Unix domain socket, until it is stopped.
+//  It gets three arguments from the console:
+//      (1) The absolute path to the train data (.csv or binary), or '-' if the model embeds the points
+//      (2) The absolute path to the kdtree model (.csv or binary)
+//      (3) The path of the socket to create
+//
+//  Options (after the three arguments):
+//      -t N        searches on a pool of N threads shared by all the clients (default: all the hardware threads).
+//      --bound B, --epsilon E, --max-checks N  approximate search, as in query_kdtree.
+//
+//  The model is replaced without dropping the connections by a reload request (query_client --reload),
+//  or by sending SIGHUP, which reloads the files given at the start. SIGINT or SIGTERM stops the server.
+//
+//  Copyright © 2016 Serim. All rights reserved.
+//
+//
+#include "QueryServer.hpp"
+#include "parallel.hpp"
+#include <string>
+#include <iostream>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <pthread.h>
+
+using std::cout;
+using std::endl;
+
+int main(int argc, const char * argv[]) {
+
+    if (argc < 4){
+        cout<< "---------------- Arguments are missing  --------------------" <<endl;
+        cout<< "Please provide 3 arguments: "<<endl;
+        cout<< "(1) The absolute path to the train data ('-' if the model embeds the points)." <<endl;
+        cout<< "(2) The absolute path of the kdtree model." <<endl;
+        cout<< "(3) The path of the socket to create." <<endl;
+        return 1;
+    }
+    const std::string fileName = argv[1];
+    const std::string modelFileName = argv[2];
+    const char* socketPath = argv[3];
+    int numThreads = parallel::defaultThreads();
+    float bound = -1;
+    float epsilon = 0;
+    int maxChecks = 0;
+    for (int i=4; i<argc; i++){
+        if (strcmp(argv[i], "-t") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+            numThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bound") == 0 && i+1 < argc && atof(argv[i+1]) > 0)
+            bound = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--epsilon") == 0 && i+1 < argc && atof(argv[i+1]) >= 0)
+            epsilon = static_cast<float>(atof(argv[++i]));
+        else if (strcmp(argv[i], "--max-checks") == 0 && i+1 < argc && atoi(argv[i+1]) > 0)
+            maxChecks = atoi(argv[++i]);
+        else{
+            cout<< "Unknown option: " << argv[i] <<endl;
+            return 1;
+        }
+    }
+
+    // the signals are taken by one thread (below), not by whichever thread happens to run
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    cout<<"------------------------------------------------------------"<<endl;
+    QueryServer server(socketPath, numThreads);
+    server.setSearch(bound, epsilon, maxChecks);
+    cout<<"... Loading the tree from: " << modelFileName << " ..."<< endl;
+    server.load(modelFileName, fileName);
+    cout<<"... " << server.numPoints() << " points of dimension " << server.dim() << " ..."<< endl;
+    cout<<"... Serving on " << socketPath << " with " << numThreads << " thread(s) ..."<< endl;
+
+    std::thread signalThread([&](){
+        while (true){
+            int signal = 0;
+            if (sigwait(&signals, &signal) != 0)
+                continue;
+            if (signal != SIGHUP){
+                server.stop();
+                return;
+            }
+            try{
+                server.load(modelFileName, fileName);
+                std::cerr<< "... Reloaded " << modelFileName << ": " << server.numPoints() << " points ..." << endl;
+            }
+            catch (const std::exception & e){
+                std::cerr<< "... Couldn't reload, the previous tree is kept: " << e.what() << " ..." << endl;
+            }
+        }
+    });
+    server.serve();
+    signalThread.join();
+
+    cout << "... Done ... " << endl;
+    return 0;
+}